@@ -0,0 +1,2 @@
+-- look up the keys named by a local table, one at a time
+select t.* from bench_ids i join :table t on t.key = :prefix || i.n::text;
@@ -0,0 +1,59 @@
+#
+# Write the inline Redis commands that load the benchmark data: keys
+# bench_<type>_1 to bench_<type>_<keys> of each type, a keyset
+# keyset_<type> listing them, and a single collection single_<type> with
+# <keys> members.
+#
+# Each collection key has <members> members, and every value is
+# <size> bytes long.
+#
+
+function member(type, m)
+{
+	if (type == "hash")
+		return "f" m " " value
+	if (type == "zset")
+		return m " " m "_" value
+	if (type == "set")
+		return m "_" value
+	return value
+}
+
+BEGIN {
+	command["scalar"] = "SET"
+	command["hash"] = "HMSET"
+	command["list"] = "RPUSH"
+	command["set"] = "SADD"
+	command["zset"] = "ZADD"
+
+	value = sprintf("%" size "s", "")
+	gsub(/ /, "x", value)
+
+	ntypes = split(types, type, " ")
+	for (t = 1; t <= ntypes; t++)
+	{
+		if (!(type[t] in command))
+		{
+			print "unknown type " type[t] > "/dev/stderr"
+			exit 1
+		}
+
+		for (k = 1; k <= keys; k++)
+		{
+			key = "bench_" type[t] "_" k
+			line = command[type[t]] " " key
+			if (type[t] == "scalar")
+				line = line " " value
+			else
+				for (m = 1; m <= members; m++)
+					line = line " " member(type[t], m)
+			printf "%s\r\n", line
+			printf "SADD keyset_%s %s\r\n", type[t], key
+		}
+
+		if (type[t] != "scalar")
+			for (k = 1; k <= keys; k++)
+				printf "%s single_%s %s\r\n", command[type[t]], type[t],
+					member(type[t], k)
+	}
+}
@@ -0,0 +1,3 @@
+-- look up one key, which is passed to Redis
+\setrandom id 1 :nkeys
+select * from :table where key = :prefix || :id::text;
@@ -0,0 +1,262 @@
+#!/bin/bash
+#
+# Benchmark scans through redis_fdw against a throwaway redis-server.
+#
+# The server is started on its own port with persistence off, loaded with
+# keys of each table type, and shut down again at the end. Each workload
+# is run with pgbench on a scratch database, and its results are written
+# as one JSON object per line. See "Benchmarks" in README.md for the
+# settings, which are all taken from the environment.
+#
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+: ${REDIS_SERVER:=redis-server}
+: ${REDIS_CLI:=redis-cli}
+: ${REDIS_PORT:=6390}
+: ${BENCH_DB:=redis_fdw_bench}
+: ${KEYS:=10000}
+: ${MEMBERS:=10}
+: ${VALUE_SIZE:=32}
+: ${JOIN_KEYS:=100}
+: ${TYPES:="scalar hash list set zset"}
+: ${LAYOUTS:="keyprefix keyset singleton"}
+: ${WORKLOADS:="scan lookup join"}
+: ${CLIENTS:=1}
+: ${DURATION:=10}
+: ${OUTPUT:=/dev/stdout}
+
+WORK=$(mktemp -d)
+
+redis()
+{
+	"$REDIS_CLI" -p "$REDIS_PORT" "$@"
+}
+
+sql()
+{
+	psql -X -q -A -t -v ON_ERROR_STOP=1 -d "$BENCH_DB" -c "$1"
+}
+
+cleanup()
+{
+	redis shutdown nosave >/dev/null 2>&1 || true
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if redis ping >/dev/null 2>&1
+then
+	echo "something is already listening on port $REDIS_PORT" >&2
+	trap - EXIT
+	rm -rf "$WORK"
+	exit 1
+fi
+
+echo "starting redis-server on port $REDIS_PORT" >&2
+"$REDIS_SERVER" --port "$REDIS_PORT" --save "" --appendonly no \
+	--dir "$WORK" --daemonize yes --pidfile "$WORK/redis.pid" >/dev/null
+until redis ping >/dev/null 2>&1
+do
+	sleep 0.1
+done
+
+echo "loading $KEYS keys of each of: $TYPES" >&2
+awk -v keys="$KEYS" -v members="$MEMBERS" -v size="$VALUE_SIZE" \
+	-v types="$TYPES" -f "$BENCH_DIR/load.awk" | redis --pipe >/dev/null
+
+dropdb --if-exists "$BENCH_DB"
+createdb "$BENCH_DB"
+psql -X -q -v ON_ERROR_STOP=1 -d "$BENCH_DB" <<EOF
+create extension redis_fdw;
+create server bench_redis foreign data wrapper redis_fdw
+       options (address '127.0.0.1', port '$REDIS_PORT');
+create user mapping for public server bench_redis;
+create table bench_ids as
+       select (1 + floor(random() * $KEYS))::int as n
+       from generate_series(1, $JOIN_KEYS);
+analyze bench_ids;
+EOF
+
+PG_VERSION=$(sql "show server_version")
+REDIS_VERSION=$(redis info server | sed -n 's/^redis_version:\([^\r]*\).*/\1/p')
+FDW_VERSION=$(git -C "$BENCH_DIR/.." describe --always --dirty 2>/dev/null ||
+			  echo unknown)
+
+#
+# make_table type layout: create the foreign table for a type and layout,
+# and print its name
+#
+make_table()
+{
+	local type=$1 layout=$2
+	local table="${type}_${layout}"
+	local columns="key text, value text[]"
+	local options="tabletype '$type'"
+
+	if [ "$type" = scalar ]
+	then
+		columns="key text, value text"
+		options=""
+	fi
+
+	case $layout in
+		keyprefix)
+			options="$options${options:+, }tablekeyprefix 'bench_${type}_'"
+			;;
+		keyset)
+			options="$options${options:+, }tablekeyset 'keyset_$type'"
+			;;
+		singleton)
+			options="$options${options:+, }singleton_key 'single_$type'"
+			case $type in
+				hash) columns="key text, value text" ;;
+				zset) columns="value text, score float8" ;;
+				*) columns="value text" ;;
+			esac
+			;;
+		*)
+			echo "unknown layout $layout" >&2
+			exit 1
+			;;
+	esac
+
+	sql "create foreign table $table ($columns) server bench_redis
+		 options ($options)"
+	echo "$table"
+}
+
+#
+# commands: the number of commands Redis has run since the last
+# CONFIG RESETSTAT, other than our own INFO
+#
+commands()
+{
+	redis info commandstats |
+		awk -F '[:=,]' '/^cmdstat_/ && !/^cmdstat_info:/ { n += $3 }
+						END { print n + 0 }'
+}
+
+#
+# reads: the number of times Redis has read from a client since the last
+# CONFIG RESETSTAT, other than for this INFO, which is about one for each
+# round trip. Empty if the server doesn't count them (before Redis 6).
+#
+reads()
+{
+	redis info stats |
+		awk -F ':' '/^total_reads_processed:/ { print $2 - 1 }'
+}
+
+#
+# p99_ms: the 99th percentile of the transaction times in pgbench's logs,
+# in milliseconds
+#
+p99_ms()
+{
+	cat "$WORK"/pgbench_log* | awk '{ print $3 }' | sort -n |
+		awk '{ t[NR] = $1 }
+			 END {
+				 i = int(NR * 0.99);
+				 if (i < NR * 0.99) i++;
+				 if (i < 1) i = 1;
+				 printf "%.3f", t[i] / 1000
+			 }'
+}
+
+#
+# run_workload type layout table workload: run one workload with pgbench,
+# and write out its results
+#
+run_workload()
+{
+	local type=$1 layout=$2 table=$3 workload=$4
+	local prefix="'bench_${type}_'"
+	local rows out txns tps cmds nreads
+
+	case $workload in
+		scan)
+			rows=$(sql "select count(*) from (select * from $table) s")
+			;;
+		lookup)
+			rows=1
+			;;
+		join)
+			rows=$(sql "select count(*) from bench_ids i join $table t
+						on t.key = $prefix || i.n::text")
+			;;
+	esac
+
+	echo "running $workload on $table" >&2
+
+	rm -f "$WORK"/pgbench_log*
+	redis config resetstat >/dev/null
+
+	out=$(pgbench -n -c "$CLIENTS" -j "$CLIENTS" -T "$DURATION" \
+				  -l --log-prefix="$WORK/pgbench_log" \
+				  -D table="$table" -D prefix="$prefix" -D nkeys="$KEYS" \
+				  -f "$BENCH_DIR/$workload.sql" "$BENCH_DB")
+
+	nreads=$(reads)
+	cmds=$(commands)
+	txns=$(echo "$out" |
+		   sed -n 's/^number of transactions actually processed: \([0-9]*\).*/\1/p')
+	tps=$(echo "$out" |
+		  sed -n 's/^tps = \([0-9.]*\) (excluding.*/\1/p')
+
+	awk -v type="$type" -v layout="$layout" -v workload="$workload" \
+		-v keys="$KEYS" -v members="$MEMBERS" -v size="$VALUE_SIZE" \
+		-v clients="$CLIENTS" -v duration="$DURATION" \
+		-v pg="$PG_VERSION" -v redis="$REDIS_VERSION" -v fdw="$FDW_VERSION" \
+		-v rows="$rows" -v txns="$txns" -v tps="$tps" -v cmds="$cmds" \
+		-v nreads="$nreads" \
+		-v p99="$(p99_ms)" \
+		'BEGIN {
+			 printf "{\"fdw_version\": \"%s\", \"pg_version\": \"%s\", " \
+					"\"redis_version\": \"%s\", ", fdw, pg, redis
+			 printf "\"type\": \"%s\", \"layout\": \"%s\", " \
+					"\"workload\": \"%s\", ", type, layout, workload
+			 printf "\"keys\": %d, \"members\": %d, \"value_size\": %d, " \
+					"\"clients\": %d, \"duration\": %d, ",
+					keys, members, size, clients, duration
+			 printf "\"rows_per_transaction\": %d, \"transactions\": %d, " \
+					"\"tps\": %.3f, \"rows_per_sec\": %.1f, ",
+					rows, txns, tps, tps * rows
+			 n = txns * rows
+			 printf "\"commands_per_row\": %.4f, ", (n > 0) ? cmds / n : 0
+			 if (nreads == "" || n == 0)
+				 printf "\"round_trips_per_row\": null, "
+			 else
+				 printf "\"round_trips_per_row\": %.4f, ", nreads / n
+			 printf "\"p99_ms\": %s}\n", p99
+		 }' >>"$OUTPUT"
+}
+
+for type in $TYPES
+do
+	for layout in $LAYOUTS
+	do
+		# a single scalar is just one row, which isn't worth measuring
+		if [ "$layout" = singleton ] && [ "$type" = scalar ]
+		then
+			continue
+		fi
+
+		table=$(make_table "$type" "$layout")
+
+		for workload in $WORKLOADS
+		do
+			# there's only one key in a singleton table
+			if [ "$layout" = singleton ] && [ "$workload" != scan ]
+			then
+				continue
+			fi
+
+			run_workload "$type" "$layout" "$table" "$workload"
+		done
+	done
+done
+
+dropdb "$BENCH_DB"
@@ -0,0 +1,2 @@
+-- read the whole table
+select * from :table;
@@ -27,6 +27,10 @@
 #endif
 
 
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -34,25 +38,48 @@
 #include <hiredis/hiredis.h>
 
 #include "funcapi.h"
+#include "access/hash.h"
+#include "access/htup_details.h"
+#include "access/sysattr.h"
 #include "access/reloptions.h"
+#include "access/skey.h"
+#include "access/xact.h"
+#include "catalog/pg_am.h"
 #include "catalog/pg_foreign_server.h"
 #include "catalog/pg_foreign_table.h"
+#include "catalog/pg_operator.h"
 #include "catalog/pg_user_mapping.h"
 #include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
+#include "commands/vacuum.h"
+#include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
 #include "miscadmin.h"
 #include "mb/pg_wchar.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#include "optimizer/var.h"
+#include "portability/instr_time.h"
 #include "storage/fd.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/pg_locale.h"
 #include "utils/rel.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 PG_MODULE_MAGIC;
 
@@ -77,6 +104,8 @@ static struct RedisFdwOption valid_options[] =
 	/* Connection options */
 	{"address", ForeignServerRelationId},
 	{"port", ForeignServerRelationId},
+	{"connection_check_interval", ForeignServerRelationId},
+	{"cluster", ForeignServerRelationId},
 	{"password", UserMappingRelationId},
 	{"database", ForeignTableRelationId},
 
@@ -85,6 +114,34 @@ static struct RedisFdwOption valid_options[] =
 	{"tablekeyprefix", ForeignTableRelationId},
 	{"tablekeyset", ForeignTableRelationId},
 	{"tabletype", ForeignTableRelationId},
+	{"lex_range", ForeignTableRelationId},
+
+	/* column options */
+	{"field", AttributeRelationId},
+
+	/* tuning options, which may be set on the server or the table */
+	{"fetch_batch_size", ForeignServerRelationId},
+	{"fetch_batch_size", ForeignTableRelationId},
+	{"use_remote_estimate", ForeignServerRelationId},
+	{"use_remote_estimate", ForeignTableRelationId},
+	{"estimate_cache_ttl", ForeignServerRelationId},
+	{"estimate_cache_ttl", ForeignTableRelationId},
+	{"write_batch_size", ForeignServerRelationId},
+	{"write_batch_size", ForeignTableRelationId},
+	{"strict_existence", ForeignServerRelationId},
+	{"strict_existence", ForeignTableRelationId},
+	{"singleton_stream", ForeignServerRelationId},
+	{"singleton_stream", ForeignTableRelationId},
+	{"scan_count", ForeignServerRelationId},
+	{"scan_count", ForeignTableRelationId},
+	{"adaptive_scan_count", ForeignServerRelationId},
+	{"adaptive_scan_count", ForeignTableRelationId},
+	{"prefetch", ForeignServerRelationId},
+	{"prefetch", ForeignTableRelationId},
+	{"scan_mode", ForeignServerRelationId},
+	{"scan_mode", ForeignTableRelationId},
+	{"scan_dedupe", ForeignServerRelationId},
+	{"scan_dedupe", ForeignTableRelationId},
 
 	/* Sentinel */
 	{NULL, InvalidOid}
@@ -99,16 +156,47 @@ typedef enum
 	PG_REDIS_ZSET_TABLE
 } redis_table_type;
 
+/*
+ * How we make the Datum for a column from what Redis sends us. Text, and
+ * text arrays from array replies, are built straight from the reply, and
+ * integer replies go straight into numeric columns; anything else goes
+ * through the type's input function.
+ */
+typedef enum
+{
+	PG_REDIS_ATT_INPUT = 0,
+	PG_REDIS_ATT_TEXT,
+	PG_REDIS_ATT_TEXTARRAY,
+	PG_REDIS_ATT_INT8,
+	PG_REDIS_ATT_FLOAT8
+} redis_att_kind;
+
 typedef struct redisTableOptions
 {
+	Oid   serverid;
+	Oid   umid;
 	char *address;
 	int   port;
 	char *password;
 	int   database;
+	int   check_interval;
 	char *keyprefix;
 	char *keyset;
 	char *singleton_key;
 	redis_table_type table_type;
+	int   fetch_batch_size;
+	bool  use_remote_estimate;
+	int   estimate_ttl;
+	int   write_batch_size;
+	bool  strict_existence;
+	bool  singleton_stream;
+	int   scan_count;
+	bool  adaptive_scan_count;
+	bool  prefetch;
+	bool  scan_script;
+	bool  scan_dedupe;
+	bool  cluster;
+	bool  lex_range;
 } redisTableOptions, *RedisTableOptions;
 
 
@@ -119,8 +207,165 @@ typedef struct
 	int			svr_port;
 	char	   *svr_password;
 	int			svr_database;
+	bool		singleton;
+	char	   *keyprefix;
+	AttrNumber	key_attnum;		/* the "key" column, if there is one */
+	redis_table_type table_type;
+	bool		lex_range;
 }	RedisFdwPlanState;
 
+/*
+ * How a singleton zset table is read: by rank, which is the whole zset, or
+ * by a range of scores or, with lex_range, of values.
+ */
+typedef enum
+{
+	PG_REDIS_ZSET_RANK = 0,
+	PG_REDIS_ZSET_SCORE,
+	PG_REDIS_ZSET_LEX
+} redis_zset_range;
+
+/* a zset table's columns are the value and the score, in that order */
+#define ZSET_VALUE_ATTNUM 1
+#define ZSET_SCORE_ATTNUM 2
+
+/*
+ * Indexes of the items in the fdw_private list of a ForeignScan.
+ */
+enum FdwScanPrivateIndex
+{
+	/* glob pattern for the keys to scan, or an empty string */
+	FdwScanPrivateKeyPattern,
+	/* integer list of the attribute numbers the scan has to return */
+	FdwScanPrivateRetrievedAttrs,
+	/*
+	 * the number of rows the query's LIMIT needs, and how many of those we
+	 * can return empty, or NIL if there's no LIMIT we can use
+	 */
+	FdwScanPrivateLimit,
+	/*
+	 * for a singleton zset, a list of the redis_zset_range, the min and max
+	 * as Redis takes them, and whether to read it backwards; otherwise NIL
+	 */
+	FdwScanPrivateZsetRange,
+	/* the planner's estimate of the rows in the table, for EXPLAIN */
+	FdwScanPrivateTableSize,
+	/*
+	 * the key column, if the query only counts its values, so the rows can
+	 * be counted like count(*) rows as long as the key isn't NULL; else 0
+	 */
+	FdwScanPrivateCountKey
+};
+
+/*
+ * Connection cache, kept for the life of the backend.
+ *
+ * Connections are keyed by server, user mapping, database and the address
+ * of the node, which is always the server's except for a cluster. A query
+ * that scans two tables from the same database at once needs two
+ * connections, so each of those can have several slots, of which only the
+ * ones not in_use are handed out.
+ */
+typedef struct RedisConnCacheKey
+{
+	Oid			serverid;
+	Oid			umid;
+	int			database;
+	char		address[256];
+	int			port;
+	int			slot;
+} RedisConnCacheKey;
+
+typedef struct RedisConnCacheEntry
+{
+	RedisConnCacheKey key;		/* hash key (must be first) */
+	redisContext *context;		/* NULL if not connected */
+	bool		in_use;			/* handed out to a scan or to the planner */
+	bool		invalidated;	/* server or mapping options have changed */
+	SubTransactionId subid;		/* subtransaction that acquired it */
+	TimestampTz last_used;		/* when it was last released */
+	uint32		server_hashvalue;	/* hash value of the server OID */
+	uint32		mapping_hashvalue;	/* hash value of the user mapping OID */
+} RedisConnCacheEntry;
+
+static HTAB *ConnectionHash = NULL;
+
+/*
+ * Cache of planner estimates, keyed by foreign table.
+ */
+typedef struct RedisEstimateEntry
+{
+	Oid			relid;			/* hash key (must be first) */
+	uint32		hashvalue;		/* hash value of the foreign table OID */
+	uint32		optionshash;	/* hash of the options it was made with */
+	TimestampTz stamp;			/* when the estimate was made */
+	double		rows;
+	int			width;			/* 0 if unknown */
+} RedisEstimateEntry;
+
+static HTAB *EstimateHash = NULL;
+
+/*
+ * Cache of Redis Cluster slot maps, keyed by foreign server. A map is read
+ * with CLUSTER SLOTS the first time the server is used, and again after a
+ * node has told us that a key has moved or the server's options change.
+ */
+#define CLUSTER_SLOTS 16384
+
+typedef struct RedisSlotMapEntry
+{
+	Oid			serverid;		/* hash key (must be first) */
+	uint32		hashvalue;		/* hash value of the server OID */
+	bool		valid;			/* false if it has to be read again */
+	int			nnodes;			/* number of masters */
+	char	  **addresses;		/* their addresses and ports, allocated */
+	int		   *ports;			/* in CacheMemoryContext */
+	int16		slots[CLUSTER_SLOTS];	/* master of each slot, or -1 */
+} RedisSlotMapEntry;
+
+static HTAB *SlotMapHash = NULL;
+
+/* how many MOVED or ASK redirections to follow for one key */
+#define CLUSTER_MAX_REDIRECTS 5
+
+/*
+ * The keys a scan with scan_dedupe has seen, so that it can drop the ones
+ * SCAN returns again. Their fingerprints are kept in an open addressing
+ * hash set while that fits in work_mem, and after that in a Bloom filter
+ * of that size, which can mistake a new key for one it has seen. Once the
+ * filter holds so many keys that that's likely, we stop deduplicating.
+ */
+typedef struct RedisSeenKeys
+{
+	MemoryContext cxt;			/* where set and bloom are allocated */
+	uint64	   *set;			/* fingerprints, with 0 for an empty slot */
+	uint64		size;			/* slots in set, a power of 2 */
+	uint64		nkeys;			/* keys seen */
+	uint8	   *bloom;			/* the Bloom filter, once set is too big */
+	uint64		nbits;			/* bits in bloom, a power of 2 */
+	int			nhashes;		/* bits set in it for each key */
+	uint64		max_keys;		/* keys bloom can hold */
+	bool		full;			/* bloom held too many, so it's gone */
+} RedisSeenKeys;
+
+/* slots in the set to start with */
+#define SEEN_KEYS_INITIAL_SIZE 1024
+
+/* the chance of a false positive the Bloom filter may reach */
+#define SEEN_KEYS_MAX_FALSE_POSITIVE 0.001
+
+/*
+ * Some of the fields of a hash, each read into its own column, and the
+ * HMGET that reads them.
+ */
+typedef struct RedisHashFields
+{
+	int			nfields;		/* 0 if we aren't using HMGET */
+	AttrNumber *attnums;		/* column of each field */
+	const char **argv;			/* HMGET, the key, then the fields */
+	size_t	   *argvlen;
+} RedisHashFields;
+
 /*
  * FDW-specific information for ForeignScanState.fdw_state.
  */
@@ -128,6 +373,9 @@ typedef struct
 typedef struct RedisFdwExecutionState
 {
 	AttInMetadata *attinmeta;
+	redis_att_kind *attkinds;	/* how to convert each column */
+	MemoryContext tuple_cxt;	/* per-tuple memory */
+	MemoryContext scan_cxt;		/* cursor and page state */
 	redisContext *context;
 	redisReply *reply;
 	long long	row;
@@ -141,13 +389,210 @@ typedef struct RedisFdwExecutionState
 	char       *singleton_key;
 	redis_table_type table_type;
 	char       *cursor_search_string;
+	char	   *key_pattern;	/* what to MATCH keys against, if anything */
 	char       *cursor_id;
+	redisReply *scan_reply;		/* whole cursor reply, owns keys */
+	char	  **keys;			/* the current page of keys to fetch */
+	size_t	   *keylens;
+	redisReply **page_values;	/* their values, from the scan script */
+	long long	nkeys;
+	RedisSeenKeys *seen_keys;	/* for scan_dedupe, or NULL */
+	bool		check_keyset;	/* keys came from a qual, not the keyset */
+	bool		fetch_values;	/* false if only the key is needed */
+	bool		strict_existence;
+	bool		check_exists;	/* check the type of keys we don't fetch */
+	bool		singleton_stream;	/* read a singleton a page at a time */
+	redisReply *page_reply;		/* whole reply for the singleton's page */
+	long long	window_start;	/* first index of the next list/zset page */
+	redis_zset_range zset_range;	/* how to read a singleton zset */
+	char	   *zset_min;		/* bounds of a score or lex range */
+	char	   *zset_max;
+	bool		zset_reverse;	/* in descending order of score */
+	int64		limit;			/* rows the query can use, or 0 for all */
+	int64		offset;			/* how many of those we return empty */
+	int64		nreturned;		/* rows returned so far */
+	int64		count_rows;		/* number of empty rows to return, or -1 */
+	AttrNumber	count_key_attnum;	/* key to set in those rows, or 0 */
+	Datum		count_key;		/* and what to set it to */
+	int			scan_count;		/* COUNT for the next page */
+	bool		adaptive_scan_count;
+	bool		prefetch;		/* ask for each page before we need it */
+	bool		scan_script;	/* pages come with their values, from the
+								 * scan script */
+	bool		prefetch_sent;	/* the next SCAN has been sent */
+	int			prefetch_ahead;	/* replies due before the SCAN reply */
+	redisReply *prefetch_reply;	/* the SCAN reply, once we've read it */
+	redisContext *batch_context;	/* where the current batch was sent */
+	MemoryContext reply_cxt;	/* holds the replies of the current batch */
+	bool		text_replies;	/* the replies being formed are from there */
+	/* hash tables with columns for single fields */
+	char	  **field_names;	/* field of each column, or NULL */
+	RedisHashFields fetch_fields;	/* fields to fetch for each row */
+	RedisHashFields filter_fields;	/* ones to fetch first for filter_quals */
+	List	   *filter_quals;	/* quals we can check on those alone */
+	ExprContext *filter_econtext;
+	TupleTableSlot *filter_slot;
+	bool		filtering;		/* fetching filter_fields, not fetch_fields */
+	redisReply **batch_filter;	/* filter_fields of the batch's rows */
+	/* Redis Cluster */
+	bool		cluster;
+	redisTableOptions *options;	/* for connecting to the nodes */
+	int			nmasters;		/* nodes from the slot map, to be scanned */
+	int			nnodes;			/* those plus any we're redirected to */
+	char	  **node_addresses;
+	int		   *node_ports;
+	redisContext **node_contexts;	/* NULL until we need them */
+	char	  **node_cursors;	/* each master's SCAN cursor, NULL when done */
+	redisReply **node_replies;	/* SCAN replies holding the current page */
+	int16	   *slots;			/* our copy of the slot map */
+	int		   *keynodes;		/* node holding each key of the page */
+	int			fetch_batch_size;
+	redisReply *batch_reply;	/* MGET reply for the current batch */
+	bool	   *batch_member;	/* keyset membership of the batch's keys */
+	bool		batch_checked;	/* batch_member is to be used */
+	long long	batch_start;	/* first key of the current batch */
+	long long	batch_end;		/* one past the last key of the batch */
+	int			pending;		/* replies sent but not yet read */
+	List	   *param_exprs;	/* key to look up for each outer row */
+	bool		param_pending;	/* key must be (re)evaluated before fetching */
+	MemoryContext param_cxt;	/* holds the key list for the current param */
+	/* what the scan cost, for EXPLAIN ANALYZE */
+	bool		instrument;		/* count bytes and time as well */
+	long		ncommands;		/* replies read */
+	long		nround_trips;	/* times we had to wait for a reply */
+	long		npages;			/* pages of keys or members read */
+	long		nskipped;		/* keys with no value for the table */
+	long		nduplicates;	/* keys dropped by scan_dedupe */
+	long		nbytes;			/* bytes of strings in the replies */
+	instr_time	wait_time;		/* time spent waiting for replies */
 }	RedisFdwExecutionState;
 
+/*
+ * FDW-specific information for ResultRelInfo.ri_FdwState.
+ */
+typedef struct RedisFdwModifyState
+{
+	redisContext *context;
+	CmdType		operation;
+	redis_table_type table_type;
+	char	   *keyprefix;
+	char	   *keyset;
+	AttrNumber	key_attnum;		/* "key" column of the table */
+	AttrNumber	value_attnum;	/* "value" column of the table */
+	AttrNumber	junk_attnum;	/* old key in the subplan's output */
+	Oid			value_type;
+	FmgrInfo	key_out;		/* output functions for key and value */
+	FmgrInfo	value_out;
+	char	  **field_names;	/* hash field of each column, or NULL */
+	FmgrInfo   *field_out;		/* output functions for those columns */
+	int			write_batch_size;
+	MemoryContext batch_cxt;	/* holds the strings of the current batch */
+	int			nrows;			/* rows in the current batch */
+	const char **argv;			/* MSET or DEL for the whole batch */
+	size_t	   *argvlen;
+	int			argc;
+	const char **setargv;		/* SADD or SREM on the keyset */
+	size_t	   *setargvlen;
+	int			setargc;
+	int			pending;		/* replies sent but not yet read */
+}	RedisFdwModifyState;
+
+/* name of the junk column holding the key for UPDATE and DELETE */
+#define REDIS_KEY_JUNK "key_junk"
+
 /* initial cursor */
 #define ZERO "0"
-/* redis default is 10 - let's fetch 1000 at a time */
-#define COUNT " COUNT 1000"
+
+/*
+ * The script for scan_mode 'script'. It takes the keyset, if there is one,
+ * as its key, and the cursor, pattern, count, the type the keys must have
+ * and the command that reads their values, with its arguments after the
+ * key, as its arguments. An empty type or command means there's no need
+ * to check or read them. It returns the next cursor and the keys of the
+ * page that have the type, each followed by its value.
+ */
+static const char *redis_scan_script =
+	"local cursor, pattern, count = ARGV[1], ARGV[2], ARGV[3]\n"
+	"local kind, command = ARGV[4], ARGV[5]\n"
+	"local page\n"
+	"if #KEYS > 0 and pattern ~= '' then\n"
+	"  page = redis.call('SSCAN', KEYS[1], cursor, 'MATCH', pattern, 'COUNT', count)\n"
+	"elseif #KEYS > 0 then\n"
+	"  page = redis.call('SSCAN', KEYS[1], cursor, 'COUNT', count)\n"
+	"elseif pattern ~= '' then\n"
+	"  page = redis.call('SCAN', cursor, 'MATCH', pattern, 'COUNT', count)\n"
+	"else\n"
+	"  page = redis.call('SCAN', cursor, 'COUNT', count)\n"
+	"end\n"
+	"local rows = {}\n"
+	"for _, key in ipairs(page[2]) do\n"
+	"  if kind == '' or redis.call('TYPE', key).ok == kind then\n"
+	"    local value = false\n"
+	"    if command ~= '' then\n"
+	"      value = redis.call(command, key, unpack(ARGV, 6))\n"
+	"    end\n"
+	"    rows[#rows + 1] = key\n"
+	"    rows[#rows + 1] = value\n"
+	"  end\n"
+	"end\n"
+	"return {page[1], rows}\n";
+
+/* its SHA1, from SCRIPT LOAD, the same on every server */
+static char *redis_scan_script_sha = NULL;
+
+/*
+ * The replies to a batch's commands are built by these functions rather
+ * than hiredis's own, in the scan's reply_cxt, which redisScanBatchReply
+ * points redis_reply_cxt at. There's nothing to free for each reply, as the
+ * whole batch goes with one reset, so freeObject does nothing. A string is
+ * built as a text datum, with str pointing at its data, so that it can go
+ * into a text column as it is.
+ */
+static MemoryContext redis_reply_cxt = NULL;
+
+#if HIREDIS_MAJOR >= 1
+typedef size_t redisArraySize;
+#else
+typedef int redisArraySize;
+#endif
+
+static void *redisCreateString(const redisReadTask *task, char *str,
+				  size_t len);
+static void *redisCreateArray(const redisReadTask *task,
+				 redisArraySize elements);
+static void *redisCreateInteger(const redisReadTask *task, long long value);
+static void *redisCreateNil(const redisReadTask *task);
+static void redisFreeObject(void *obj);
+
+static redisReplyObjectFunctions redis_batch_functions = {
+	.createString = redisCreateString,
+	.createArray = redisCreateArray,
+	.createInteger = redisCreateInteger,
+	.createNil = redisCreateNil,
+	.freeObject = redisFreeObject
+};
+
+/* the size of a reply object, before what we put after it */
+#define REDIS_REPLY_SIZE MAXALIGN(sizeof(redisReply))
+/* redis default is 10 - let's fetch 1000 at a time, unless scan_count is set */
+#define COUNT " COUNT %d"
+#define DEFAULT_SCAN_COUNT 1000
+/* bounds and targets for adaptive_scan_count */
+#define MIN_SCAN_COUNT 10
+#define MAX_SCAN_COUNT 100000
+#define SCAN_TARGET_USEC 2000
+#define SCAN_TARGET_BYTES (256 * 1024)
+/* number of value fetches to pipeline, unless fetch_batch_size is set */
+#define DEFAULT_FETCH_BATCH_SIZE 100
+/* number of rows to write at a time, unless write_batch_size is set */
+#define DEFAULT_WRITE_BATCH_SIZE 1000
+/* seconds a cached connection may sit idle before we PING it on reuse */
+#define DEFAULT_CHECK_INTERVAL 60
+/* seconds to keep a table's row count and width estimates */
+#define DEFAULT_ESTIMATE_TTL 60
+/* bounds on the sample taken for use_remote_estimate */
+#define ESTIMATE_SAMPLE_PAGES 10
+#define ESTIMATE_SAMPLE_KEYS 100
 
 /*
  * SQL functions
@@ -180,14 +625,197 @@ static inline TupleTableSlot *redisIterateForeignScanMulti(ForeignScanState *nod
 static inline TupleTableSlot *redisIterateForeignScanSingleton(ForeignScanState *node);
 static void redisReScanForeignScan(ForeignScanState *node);
 static void redisEndForeignScan(ForeignScanState *node);
+static bool redisAnalyzeForeignTable(Relation relation,
+						 AcquireSampleRowsFunc *func,
+						 BlockNumber *totalpages);
+static int redisAcquireSampleRowsFunc(Relation relation, int elevel,
+						   HeapTuple *rows, int targrows,
+						   double *totalrows,
+						   double *totaldeadrows);
+static void redisAddForeignUpdateTargets(Query *parsetree,
+							 RangeTblEntry *target_rte,
+							 Relation target_relation);
+static void redisBeginForeignModify(ModifyTableState *mtstate,
+						ResultRelInfo *rinfo,
+						List *fdw_private,
+						int subplan_index,
+						int eflags);
+static TupleTableSlot *redisExecForeignInsert(EState *estate,
+					   ResultRelInfo *rinfo,
+					   TupleTableSlot *slot,
+					   TupleTableSlot *planSlot);
+static TupleTableSlot *redisExecForeignUpdate(EState *estate,
+					   ResultRelInfo *rinfo,
+					   TupleTableSlot *slot,
+					   TupleTableSlot *planSlot);
+static TupleTableSlot *redisExecForeignDelete(EState *estate,
+					   ResultRelInfo *rinfo,
+					   TupleTableSlot *slot,
+					   TupleTableSlot *planSlot);
+static void redisEndForeignModify(EState *estate, ResultRelInfo *rinfo);
+static int	redisIsForeignRelUpdatable(Relation rel);
 
 /*
  * Helper functions
  */
 static bool redisIsValidOption(const char *option, Oid context);
 static void redisGetOptions(Oid foreigntableid, RedisTableOptions options); 
-static void redisGetQual(Node *node, TupleDesc tupdesc, char **key, char **value, bool *pushdown);
+static void redisGetQual(Node *node, TupleDesc tupdesc, char **key, char **value, List **values, bool *pushdown);
 static char *process_redis_array(redisReply *reply,	redis_table_type type);
+static void redisValidateIntOption(DefElem *def, int minval);
+static Expr *redisGetParamKeyExpr(RelOptInfo *baserel, AttrNumber key_attnum,
+					 Expr *clause);
+static bool redisIsKeyVar(Node *node, RelOptInfo *baserel,
+			  AttrNumber key_attnum);
+static bool redisKeyMemberMatches(PlannerInfo *root, RelOptInfo *baserel,
+					  EquivalenceClass *ec, EquivalenceMember *em,
+					  void *arg);
+static char *redisGetKeyPattern(RelOptInfo *baserel, AttrNumber key_attnum,
+				   const char *keyprefix, Expr *clause, bool *lossy);
+static void redisAppendGlobChar(StringInfo buf, char c);
+static char *redisLikeToGlob(const char *pattern, bool *lossy);
+static char *redisRegexToGlob(const char *pattern, bool *lossy);
+static bool redisGlobHasPrefix(const char *glob, const char *prefix);
+static List *redisRetrievedAttrs(Bitmapset *attrs_used, AttrNumber natts);
+static AttrNumber redisGetCountKey(PlannerInfo *root, RelOptInfo *baserel,
+				 AttrNumber key_attnum, List *retrieved_attrs,
+				 List *local_quals);
+static bool redisCountKeyWalker(Node *node, Var *key);
+static int	redisZsetScoreOrder(PlannerInfo *root, RelOptInfo *baserel);
+static bool redisIsScoreType(Oid type);
+static Oid	redisBtreeFamily(Oid type);
+static Const *redisGetRangeBound(RelOptInfo *baserel, AttrNumber attnum,
+				   Expr *clause, int *strategy, Oid *type);
+static List *redisGetZsetRange(RelOptInfo *baserel,
+				  RedisFdwPlanState *fdw_private, List *scan_clauses,
+				  List *retrieved_attrs, bool reverse, List **exact);
+static int64 redisGetLimit(PlannerInfo *root, RelOptInfo *baserel,
+			  ForeignPath *best_path, List *local_quals, int64 *offset);
+static double redisConstDouble(Const *bound);
+static bool redisIsKeyLookup(RelOptInfo *baserel, AttrNumber key_attnum,
+				 Expr *clause);
+static void redisSetParamKey(ForeignScanState *node,
+				 RedisFdwExecutionState *festate);
+static void redisStartCursor(RedisFdwExecutionState *festate);
+static bool redisFetchSingletonPage(RedisFdwExecutionState *festate);
+static redisReply *redisZsetCommand(RedisFdwExecutionState *festate,
+				 redisContext *context, long long start, long long count);
+static bool redisCountRows(RedisFdwExecutionState *festate,
+			   redisContext *context);
+static void redisAdaptScanCount(RedisFdwExecutionState *festate,
+					instr_time *start, redisReply *elements);
+static void redisSendScan(RedisFdwExecutionState *festate);
+static int	redisAppendKeyCommand(RedisFdwExecutionState *festate,
+					  redisContext *context, const char *key, size_t keylen);
+static void redisReadMembership(RedisFdwExecutionState *festate,
+					redisContext *context, long long first, long long last);
+static redisReply *redisGetKeyReply(RedisFdwExecutionState *festate,
+				 long long row);
+static redisContext *redisGetTableConnection(RedisTableOptions table_options);
+static redisContext *redisGetNodeConnection(RedisTableOptions table_options,
+					   const char *address, int port);
+static RedisSlotMapEntry *redisGetSlotMap(RedisTableOptions table_options);
+static void redisInvalidateSlotMaps(Datum arg, int cacheid,
+						uint32 hashvalue);
+static int	redisKeySlot(const char *key, size_t keylen);
+static void redisClusterBeginScan(RedisFdwExecutionState *festate,
+					  RedisTableOptions table_options);
+static void redisClusterEndScan(RedisFdwExecutionState *festate);
+static int	redisClusterNode(RedisFdwExecutionState *festate,
+				 const char *address, int port);
+static redisContext *redisClusterConnection(RedisFdwExecutionState *festate,
+					   int node);
+static void redisClusterFetchNextPage(RedisFdwExecutionState *festate);
+static void redisClusterRoutePage(RedisFdwExecutionState *festate);
+static redisReply *redisClusterRedirect(RedisFdwExecutionState *festate,
+					 const char *key, size_t keylen,
+					 redisReply *reply);
+static redisReply *redisGetPrefetchedPage(RedisFdwExecutionState *festate);
+static void redisPollPrefetch(RedisFdwExecutionState *festate);
+static void redisFetchNextPage(RedisFdwExecutionState *festate);
+static bool redisFetchNextValue(RedisFdwExecutionState *festate, char **keyp,
+					redisReply **replyp);
+static bool redisKeyHasType(redisReply *reply, redis_table_type type);
+static char **redisGetHashFields(Relation rel);
+static void redisSetupHashFields(ForeignScanState *node,
+					 RedisFdwExecutionState *festate, List *retrieved_attrs);
+static void redisSetHashFields(RedisHashFields *fields, char **field_names,
+				   Bitmapset *attnums);
+static int	redisAppendHashFields(redisContext *context,
+					  RedisHashFields *fields, const char *key, size_t keylen);
+static void redisFormHashFields(RedisFdwExecutionState *festate,
+					RedisHashFields *fields, redisReply *reply,
+					Datum *values, bool *nulls);
+static void redisPickHashFields(RedisFdwExecutionState *festate,
+					redisReply *reply, Datum *values, bool *nulls);
+static void redisReadExists(RedisFdwExecutionState *festate,
+				long long first, long long last);
+static void redisFilterBatch(RedisFdwExecutionState *festate,
+				 long long first, long long last);
+static bool redisCheckFilter(RedisFdwExecutionState *festate, char *key,
+				 redisReply *reply);
+static void redisFreeBatch(RedisFdwExecutionState *festate);
+static void redisFormMultiRow(RedisFdwExecutionState *festate, char *key,
+				  redisReply *reply, Datum *values, bool *nulls);
+static redis_att_kind *redisGetAttKinds(TupleDesc tupdesc);
+static Datum redisStringDatum(RedisFdwExecutionState *festate, int attnum,
+				 const char *str, size_t len);
+static Datum redisArrayDatum(RedisFdwExecutionState *festate,
+				redisReply *reply);
+static Datum redisReplyDatum(RedisFdwExecutionState *festate, int attnum,
+				redisReply *reply, bool *isnull);
+static void redisSetKeyList(RedisFdwExecutionState *festate, List *values);
+static int	redisCompareKeys(const void *a, const void *b);
+static void redisSendValueBatch(RedisFdwExecutionState *festate);
+static redisReply *redisGetPendingReply(RedisFdwExecutionState *festate);
+static void redisDrainPending(RedisFdwExecutionState *festate);
+static void redisLoadScanScript(RedisFdwExecutionState *festate);
+static int	redisScanBatchReply(RedisFdwExecutionState *festate,
+					redisContext *context, redisReply **replyp);
+static redisReply *redisNewReply(const redisReadTask *task, size_t extra);
+static int	redisAppendScanScript(RedisFdwExecutionState *festate);
+static const char *redisTableTypeName(redis_table_type type);
+static void redisDedupePage(RedisFdwExecutionState *festate, bool with_nodes);
+static RedisSeenKeys *redisCreateSeenKeys(void);
+static void redisResetSeenKeys(RedisSeenKeys *seen);
+static bool redisSeenKey(RedisSeenKeys *seen, const char *key, size_t keylen);
+static uint64 redisKeyFingerprint(const char *key, size_t keylen);
+static void redisSeenKeysToBloom(RedisSeenKeys *seen);
+static int	redisScanReply(RedisFdwExecutionState *festate,
+			   redisContext *context, redisReply **replyp);
+static redisReply *redisScanCommand(RedisFdwExecutionState *festate,
+				 redisContext *context, const char *format,...);
+static long redisReplyBytes(redisReply *reply);
+static Oid	redisGetUserMappingOid(Oid userid, Oid serverid);
+static AttrNumber redisGetAttnum(TupleDesc tupdesc, const char *attname);
+static char *redisGetWriteKey(RedisFdwModifyState *fmstate,
+				 TupleTableSlot *slot, AttrNumber attnum, bool junk);
+static void redisQueueValue(RedisFdwModifyState *fmstate, char *key,
+				TupleTableSlot *slot);
+static void redisFlushWriteBatch(RedisFdwModifyState *fmstate);
+static void redisResetWriteBatch(RedisFdwModifyState *fmstate);
+static void redisWriteError(RedisFdwModifyState *fmstate);
+static void redisEstimateRelSize(redisContext *context,
+					 RedisTableOptions table_options,
+					 double *rows, int *width);
+static bool redisSampleWidths(redisContext *context, int nsample, int *width);
+static uint32 redisEstimateOptionsHash(RedisTableOptions table_options);
+static bool redisLookupEstimate(Oid foreigntableid,
+					RedisTableOptions table_options,
+					double *rows, int *width);
+static void redisStoreEstimate(Oid foreigntableid,
+				   RedisTableOptions table_options,
+				   double rows, int width);
+static void redisInvalidateEstimates(Datum arg, int cacheid, uint32 hashvalue);
+static redisContext *redisConnectServer(RedisTableOptions table_options);
+static redisContext *redisGetConnection(RedisTableOptions table_options);
+static void redisReleaseConnection(redisContext *context);
+static void redisInvalidateConnections(Datum arg, int cacheid,
+						   uint32 hashvalue);
+static void redisXactCallback(XactEvent event, void *arg);
+static void redisSubXactCallback(SubXactEvent event,
+					 SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg);
 /*
  * Foreign-data wrapper handler function: return a struct with pointers
  * to my callback routines.
@@ -204,14 +832,22 @@ redis_fdw_handler(PG_FUNCTION_ARGS)
 	fdwroutine->GetForeignRelSize = redisGetForeignRelSize;
 	fdwroutine->GetForeignPaths = redisGetForeignPaths;
 	fdwroutine->GetForeignPlan = redisGetForeignPlan;
-	/* can't ANALYSE redis */
-	fdwroutine->AnalyzeForeignTable = NULL;
+	fdwroutine->AnalyzeForeignTable = redisAnalyzeForeignTable;
 	fdwroutine->ExplainForeignScan = redisExplainForeignScan;
 	fdwroutine->BeginForeignScan = redisBeginForeignScan;
 	fdwroutine->IterateForeignScan = redisIterateForeignScan;
 	fdwroutine->ReScanForeignScan = redisReScanForeignScan;
 	fdwroutine->EndForeignScan = redisEndForeignScan;
 
+	fdwroutine->AddForeignUpdateTargets = redisAddForeignUpdateTargets;
+	fdwroutine->PlanForeignModify = NULL;
+	fdwroutine->BeginForeignModify = redisBeginForeignModify;
+	fdwroutine->ExecForeignInsert = redisExecForeignInsert;
+	fdwroutine->ExecForeignUpdate = redisExecForeignUpdate;
+	fdwroutine->ExecForeignDelete = redisExecForeignDelete;
+	fdwroutine->EndForeignModify = redisEndForeignModify;
+	fdwroutine->IsForeignRelUpdatable = redisIsForeignRelUpdatable;
+
 	PG_RETURN_POINTER(fdwroutine);
 }
 
@@ -411,11 +1047,65 @@ redis_fdw_validator(PG_FUNCTION_ARGS)
 						 errmsg("invalid tabletype (%s) - must be hash, "
 								"list, set or zset", typeval)));
 		}
+		else if (strcmp(def->defname, "scan_mode") == 0)
+		{
+			char	   *mode = defGetString(def);
+
+			if (strcmp(mode, "client") != 0 && strcmp(mode, "script") != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("invalid scan_mode (%s) - must be client or "
+								"script", mode)));
+		}
+		else if (strcmp(def->defname, "fetch_batch_size") == 0 ||
+				 strcmp(def->defname, "write_batch_size") == 0 ||
+				 strcmp(def->defname, "scan_count") == 0)
+		{
+			redisValidateIntOption(def, 1);
+		}
+		else if (strcmp(def->defname, "connection_check_interval") == 0 ||
+				 strcmp(def->defname, "estimate_cache_ttl") == 0)
+		{
+			redisValidateIntOption(def, 0);
+		}
+		else if (strcmp(def->defname, "use_remote_estimate") == 0 ||
+				 strcmp(def->defname, "strict_existence") == 0 ||
+				 strcmp(def->defname, "singleton_stream") == 0 ||
+				 strcmp(def->defname, "adaptive_scan_count") == 0 ||
+				 strcmp(def->defname, "prefetch") == 0 ||
+				 strcmp(def->defname, "scan_dedupe") == 0 ||
+				 strcmp(def->defname, "cluster") == 0 ||
+				 strcmp(def->defname, "lex_range") == 0)
+		{
+			/* just check that it's a valid boolean */
+			(void) defGetBoolean(def);
+		}
 	}
 
 	PG_RETURN_VOID();
 }
 
+/*
+ * Check that a numeric option is an integer no smaller than minval.
+ */
+static void
+redisValidateIntOption(DefElem *def, int minval)
+{
+	char	   *val = defGetString(def);
+	char	   *endp;
+	long		intval;
+
+	errno = 0;
+	intval = strtol(val, &endp, 10);
+
+	if (endp == val || *endp != '\0' || errno == ERANGE ||
+		intval < minval || intval > INT_MAX)
+		ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("invalid %s (%s) - must be an integer no less "
+						"than %d", def->defname, val, minval)));
+}
+
 
 /*
  * Check if the provided option is one of the valid options.
@@ -463,12 +1153,39 @@ redisGetOptions(Oid foreigntableid,RedisTableOptions table_options)
 	server = GetForeignServer(table->serverid);
 	mapping = GetUserMapping(GetUserId(), table->serverid);
 
+	table_options->serverid = table->serverid;
+	table_options->umid = redisGetUserMappingOid(GetUserId(), table->serverid);
+	table_options->address = NULL;
+	table_options->port = 0;
+	table_options->password = NULL;
+	table_options->database = 0;
+	table_options->check_interval = -1;
+	table_options->keyprefix = NULL;
+	table_options->keyset = NULL;
+	table_options->singleton_key = NULL;
+	table_options->table_type = PG_REDIS_SCALAR_TABLE;
+	table_options->fetch_batch_size = 0;
+	table_options->use_remote_estimate = false;
+	table_options->estimate_ttl = -1;
+	table_options->write_batch_size = 0;
+	table_options->strict_existence = true;
+	table_options->singleton_stream = true;
+	table_options->scan_count = 0;
+	table_options->adaptive_scan_count = false;
+	table_options->prefetch = false;
+	table_options->scan_script = false;
+	table_options->scan_dedupe = false;
+	table_options->cluster = false;
+	table_options->lex_range = false;
+
+	/*
+	 * Some tuning options can be set on both the server and the table, so
+	 * put the table options last to let them override the server's.
+	 */
 	options = NIL;
-	options = list_concat(options, table->options);
 	options = list_concat(options, server->options);
 	options = list_concat(options, mapping->options);
-
-//	table_options->table_type = PG_REDIS_SCALAR_TABLE;
+	options = list_concat(options, table->options);
 
 	/* Loop through the options, and get the server/port */
 	foreach(lc, options)
@@ -509,6 +1226,49 @@ redisGetOptions(Oid foreigntableid,RedisTableOptions table_options)
 			else if (strcmp(typeval,"zset") == 0)
 				table_options->table_type = PG_REDIS_ZSET_TABLE;
 		}
+
+		if (strcmp(def->defname, "fetch_batch_size") == 0)
+			table_options->fetch_batch_size = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "connection_check_interval") == 0)
+			table_options->check_interval = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "use_remote_estimate") == 0)
+			table_options->use_remote_estimate = defGetBoolean(def);
+
+		if (strcmp(def->defname, "estimate_cache_ttl") == 0)
+			table_options->estimate_ttl = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "write_batch_size") == 0)
+			table_options->write_batch_size = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "strict_existence") == 0)
+			table_options->strict_existence = defGetBoolean(def);
+
+		if (strcmp(def->defname, "singleton_stream") == 0)
+			table_options->singleton_stream = defGetBoolean(def);
+
+		if (strcmp(def->defname, "scan_count") == 0)
+			table_options->scan_count = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "adaptive_scan_count") == 0)
+			table_options->adaptive_scan_count = defGetBoolean(def);
+
+		if (strcmp(def->defname, "prefetch") == 0)
+			table_options->prefetch = defGetBoolean(def);
+
+		if (strcmp(def->defname, "scan_mode") == 0)
+			table_options->scan_script =
+				(strcmp(defGetString(def), "script") == 0);
+
+		if (strcmp(def->defname, "scan_dedupe") == 0)
+			table_options->scan_dedupe = defGetBoolean(def);
+
+		if (strcmp(def->defname, "cluster") == 0)
+			table_options->cluster = defGetBoolean(def);
+
+		if (strcmp(def->defname, "lex_range") == 0)
+			table_options->lex_range = defGetBoolean(def);
 	}
 
 	/* Default values, if required */
@@ -520,984 +1280,6492 @@ redisGetOptions(Oid foreigntableid,RedisTableOptions table_options)
 
 	if (!table_options->database)
 		table_options->database = 0;
-}
 
+	if (!table_options->fetch_batch_size)
+		table_options->fetch_batch_size = DEFAULT_FETCH_BATCH_SIZE;
 
-static void
-redisGetForeignRelSize(PlannerInfo *root,
-					   RelOptInfo *baserel,
-					   Oid foreigntableid)
+	if (!table_options->write_batch_size)
+		table_options->write_batch_size = DEFAULT_WRITE_BATCH_SIZE;
+
+	if (!table_options->scan_count)
+		table_options->scan_count = DEFAULT_SCAN_COUNT;
+
+	if (table_options->check_interval < 0)
+		table_options->check_interval = DEFAULT_CHECK_INTERVAL;
+
+	if (table_options->estimate_ttl < 0)
+		table_options->estimate_ttl = DEFAULT_ESTIMATE_TTL;
+
+	if (table_options->cluster && table_options->database != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+				 errmsg("a Redis Cluster only has database 0")
+				 ));
+}
+
+/*
+ * Find the OID of the user mapping GetUserMapping would use, falling back
+ * to the PUBLIC mapping the same way it does.
+ */
+static Oid
+redisGetUserMappingOid(Oid userid, Oid serverid)
 {
-	RedisFdwPlanState *fdw_private;
-	redisTableOptions table_options;
+	HeapTuple	tp;
+	Oid			umid;
 
-	redisContext *context;
-	redisReply *reply;
-	struct timeval timeout = {1, 500000};
+	tp = SearchSysCache2(USERMAPPINGUSERSERVER,
+						 ObjectIdGetDatum(userid),
+						 ObjectIdGetDatum(serverid));
 
-#ifdef DEBUG
-	elog(NOTICE, "redisGetForeignRelSize");
-#endif
+	if (!HeapTupleIsValid(tp))
+		tp = SearchSysCache2(USERMAPPINGUSERSERVER,
+							 ObjectIdGetDatum(InvalidOid),
+							 ObjectIdGetDatum(serverid));
 
-	/*
-	 * Fetch options. Get everything so we don't need to re-fetch it later in
-	 * planning.
-	 */
-	fdw_private = (RedisFdwPlanState *) palloc(sizeof(RedisFdwPlanState));
-	baserel->fdw_private = (void *) fdw_private;
+	/* GetUserMapping will already have complained if there's none */
+	if (!HeapTupleIsValid(tp))
+		return InvalidOid;
 
-	table_options.address = NULL;
-	table_options.port = 0;
-	table_options.password = NULL;
-	table_options.database = 0;
-	table_options.keyprefix = NULL;
-	table_options.keyset = NULL;
-	table_options.singleton_key = NULL;
-	table_options.table_type = PG_REDIS_SCALAR_TABLE;
+	umid = HeapTupleGetOid(tp);
+	ReleaseSysCache(tp);
 
-	redisGetOptions(foreigntableid, &table_options);
-	fdw_private->svr_address = table_options.address;
-	fdw_private->svr_password = table_options.password;
-	fdw_private->svr_port = table_options.port;
-	fdw_private->svr_database = table_options.database;
+	return umid;
+}
+
+/*
+ * redisConnectServer
+ *		Open a new connection, authenticate and select the database.
+ */
+static redisContext *
+redisConnectServer(RedisTableOptions table_options)
+{
+	redisContext *context;
+	redisReply *reply;
+	struct timeval timeout = {1, 500000};
 
-	/* Connect to the database */
-	context = redisConnectWithTimeout(table_options.address, table_options.port,
-									  timeout);
+	/* Connect to the server */
+	context = redisConnectWithTimeout(table_options->address, 
+									  table_options->port, timeout);
+
+	if (context == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_OUT_OF_MEMORY),
+				 errmsg("failed to allocate a Redis connection")
+				 ));
 
 	if (context->err)
+	{
+		char	   *err = pstrdup(context->errstr);
+
+		redisFree(context);
 		ereport(ERROR,
 				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-				 errmsg("failed to connect to Redis: %d", context->err)
+				 errmsg("failed to connect to Redis: %s", err)
 				 ));
+	}
 
 	/* Authenticate */
-	if (table_options.password)
+	if (table_options->password)
 	{
-		reply = redisCommand(context, "AUTH %s", table_options.password);
+		reply = redisCommand(context, "AUTH %s", table_options->password);
 
-		if (!reply)
+		if (!reply || reply->type == REDIS_REPLY_ERROR)
 		{
+			char	   *err = pstrdup(reply ? reply->str : context->errstr);
+
+			if (reply)
+				freeReplyObject(reply);
 			redisFree(context);
 			ereport(ERROR,
 					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-					 errmsg("failed to authenticate to redis: %d", 
-							context->err)));
+			   errmsg("failed to authenticate to redis: %s", err)
+					 ));
 		}
 
 		freeReplyObject(reply);
 	}
 
+	/* A cluster only has database 0, and won't SELECT anything else */
+	if (table_options->cluster)
+		return context;
+
 	/* Select the appropriate database */
-	reply = redisCommand(context, "SELECT %d", table_options.database);
+	reply = redisCommand(context, "SELECT %d", table_options->database);
 
-	if (!reply)
+	if (!reply || reply->type == REDIS_REPLY_ERROR)
 	{
+		char	   *err = pstrdup(reply ? reply->str : context->errstr);
+
+		if (reply)
+			freeReplyObject(reply);
 		redisFree(context);
 		ereport(ERROR,
-				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
-				 errmsg("failed to select database %d: %d", 
-						table_options.database,  context->err)
+				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+				 errmsg("failed to select database %d: %s", 
+						table_options->database, err)
 				 ));
 	}
 
-	/* Execute a query to get the table size */
-#if 0
-	/*
-	 * KEYS is potentiallyexpensive, so this test is disabled and we use a
-	 * fairly dubious heuristic instead.
-	 */
-	if (table_options.keyprefix)
-	{
-		/* it's a pity there isn't an NKEYS command in Redis */
-		int len = strlen(table_options.keyprefix) + 2;
-		char *buff = palloc(len * sizeof(char));
-		snprintf(buff,len, "%s*",table_options.keyprefix);
-		reply = redisCommand(context,"KEYS %s",buff);
-	} else
-#endif
-	if (table_options.singleton_key)
+	freeReplyObject(reply);
+
+	return context;
+}
+
+/*
+ * redisGetConnection
+ *		Get a connection for the server, user mapping and database, reusing
+ *		a cached one if there's one free.
+ *
+ * The connection must be given back with redisReleaseConnection. If the
+ * transaction aborts first, it is closed instead, since we can't know what
+ * state the protocol was left in.
+ */
+static redisContext *
+redisGetConnection(RedisTableOptions table_options)
+{
+	RedisConnCacheEntry *entry;
+	RedisConnCacheKey key;
+	bool		found;
+
+	/* First time through, set up the hash table and the callbacks */
+	if (ConnectionHash == NULL)
 	{
-		switch (table_options.table_type)
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(RedisConnCacheKey);
+		ctl.entrysize = sizeof(RedisConnCacheEntry);
+		ctl.hcxt = CacheMemoryContext;
+		ConnectionHash = hash_create("redis_fdw connections", 8, &ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		RegisterXactCallback(redisXactCallback, NULL);
+		RegisterSubXactCallback(redisSubXactCallback, NULL);
+		CacheRegisterSyscacheCallback(FOREIGNSERVEROID,
+									  redisInvalidateConnections, (Datum) 0);
+		CacheRegisterSyscacheCallback(USERMAPPINGOID,
+									  redisInvalidateConnections, (Datum) 0);
+	}
+
+	/* Find the first slot that isn't in use */
+	memset(&key, 0, sizeof(key));
+	key.serverid = table_options->serverid;
+	key.umid = table_options->umid;
+	key.database = table_options->database;
+	strlcpy(key.address, table_options->address, sizeof(key.address));
+	key.port = table_options->port;
+
+	for (key.slot = 0;; key.slot++)
+	{
+		entry = hash_search(ConnectionHash, &key, HASH_ENTER, &found);
+
+		if (!found)
 		{
-			case PG_REDIS_SCALAR_TABLE:
-				baserel->rows = 1;
-				return;
-			case PG_REDIS_HASH_TABLE:
-				reply = redisCommand(context, "HLEN %s",table_options.singleton_key);
-				break;
-			case PG_REDIS_LIST_TABLE:
-				reply = redisCommand(context, "LLEN %s",table_options.singleton_key);
-				break;
-			case PG_REDIS_SET_TABLE:
-				reply = redisCommand(context, "SCARD %s",table_options.singleton_key);
-				break;
-			case PG_REDIS_ZSET_TABLE:
-				reply = redisCommand(context, "ZCARD %s",table_options.singleton_key);
-				break;
-			default:
-				;
+			entry->context = NULL;
+			entry->in_use = false;
+			entry->invalidated = false;
 		}
+
+		if (!entry->in_use)
+			break;
 	}
-	else if (table_options.keyset)
-	{ 
-		reply = redisCommand(context,"SCARD %s",table_options.keyset);
-	}
-	else
+
+	/* Throw away the connection if it's stale or known to be broken */
+	if (entry->context &&
+		(entry->invalidated || entry->context->err))
 	{
-		reply = redisCommand(context, "DBSIZE");
+		redisFree(entry->context);
+		entry->context = NULL;
 	}
 
-	if (!reply)
+	/*
+	 * If it's been idle for a while the server may have timed it out, so
+	 * make sure it's still alive.
+	 */
+	if (entry->context &&
+		TimestampDifferenceExceeds(entry->last_used, GetCurrentTimestamp(),
+								   table_options->check_interval * 1000))
 	{
-		redisFree(context);
-		ereport(ERROR,
-				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
-				 errmsg("failed to get the database size: %d", context->err)
-				 ));
-	}
+		redisReply *reply = redisCommand(entry->context, "PING");
 
-#if 0
-	if (reply->type == REDIS_REPLY_ARRAY)
-		baserel->rows = reply->elements;
-	else
-#endif
-		if (table_options.keyprefix)
-			baserel->rows = reply->integer / 20;
-		else
-			baserel->rows = reply->integer;
+		if (!reply || reply->type == REDIS_REPLY_ERROR)
+		{
+			redisFree(entry->context);
+			entry->context = NULL;
+		}
 
-	freeReplyObject(reply);
-	redisFree(context);
+		if (reply)
+			freeReplyObject(reply);
+	}
+
+	if (entry->context == NULL)
+	{
+		entry->context = redisConnectServer(table_options);
+		entry->invalidated = false;
+		entry->server_hashvalue =
+			GetSysCacheHashValue1(FOREIGNSERVEROID,
+								  ObjectIdGetDatum(key.serverid));
+		entry->mapping_hashvalue =
+			GetSysCacheHashValue1(USERMAPPINGOID,
+								  ObjectIdGetDatum(key.umid));
+	}
 
+	entry->in_use = true;
+	entry->subid = GetCurrentSubTransactionId();
 
+	return entry->context;
 }
 
 /*
- * redisGetForeignPaths
- *		Create possible access paths for a scan on the foreign table
- *
- *		Currently we don't support any push-down feature, so there is only one
- *		possible access path, which simply returns all records in redis.
+ * redisReleaseConnection
+ *		Hand a connection back to the cache. The caller must have read all
+ *		the replies it was expecting.
  */
 static void
-redisGetForeignPaths(PlannerInfo *root,
-					 RelOptInfo *baserel,
-					 Oid foreigntableid)
+redisReleaseConnection(redisContext *context)
 {
-	RedisFdwPlanState *fdw_private = baserel->fdw_private;
+	HASH_SEQ_STATUS scan;
+	RedisConnCacheEntry *entry;
 
-	Cost		startup_cost,
-				total_cost;
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (RedisConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->context != context)
+			continue;
 
-#ifdef DEBUG
-	elog(NOTICE, "redisGetForeignPaths");
-#endif
+		entry->in_use = false;
+		entry->last_used = GetCurrentTimestamp();
 
-	if (strcmp(fdw_private->svr_address, "127.0.0.1") == 0 ||
-		strcmp(fdw_private->svr_address, "localhost") == 0)
-		startup_cost = 10;
-	else
-		startup_cost = 25;
+		/* don't keep it if it's broken or its options have changed */
+		if (entry->invalidated || context->err)
+		{
+			redisFree(context);
+			entry->context = NULL;
+		}
 
-	total_cost = startup_cost + baserel->rows;
+		hash_seq_term(&scan);
+		break;
+	}
+}
 
+/*
+ * Syscache callback: the options of a foreign server or user mapping have
+ * changed, so the connections made with them shouldn't be reused.
+ */
+static void
+redisInvalidateConnections(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS scan;
+	RedisConnCacheEntry *entry;
 
-	/* Create a ForeignPath node and add it as only possible path */
-	add_path(baserel, (Path *)
-			 create_foreignscan_path(root, baserel,
-									 baserel->rows,
-									 startup_cost,
-									 total_cost,
-									 NIL,		/* no pathkeys */
-									 NULL,		/* no outer rel either */
-									 NIL));		/* no fdw_private data */
-
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (RedisConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->context == NULL)
+			continue;
+
+		/* hashvalue == 0 means a cache reset, so invalidate everything */
+		if (hashvalue == 0 ||
+			(cacheid == FOREIGNSERVEROID &&
+			 entry->server_hashvalue == hashvalue) ||
+			(cacheid == USERMAPPINGOID &&
+			 entry->mapping_hashvalue == hashvalue))
+			entry->invalidated = true;
+	}
 }
 
-static ForeignScan *
-redisGetForeignPlan(PlannerInfo *root,
-					RelOptInfo *baserel,
-					Oid foreigntableid,
-					ForeignPath *best_path,
-					List *tlist,
-					List *scan_clauses)
+/*
+ * Transaction callbacks: any connection still in use when a (sub)transaction
+ * aborts was abandoned by an error part way through a command or a pipeline,
+ * so close it rather than hand it out again.
+ */
+static void
+redisXactCallback(XactEvent event, void *arg)
 {
-	Index		scan_relid = baserel->relid;
+	HASH_SEQ_STATUS scan;
+	RedisConnCacheEntry *entry;
 
-#ifdef DEBUG
-	elog(NOTICE, "redisGetForeignPlan");
-#endif
+	if (event != XACT_EVENT_ABORT && event != XACT_EVENT_PARALLEL_ABORT)
+		return;
 
-	/*
-	 * We have no native ability to evaluate restriction clauses, so we just
-	 * put all the scan_clauses into the plan node's qual list for the
-	 * executor to check.  So all we have to do here is strip RestrictInfo
-	 * nodes from the clauses and ignore pseudoconstants (which will be
-	 * handled elsewhere).
-	 */
-	scan_clauses = extract_actual_clauses(scan_clauses, false);
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (RedisConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (!entry->in_use)
+			continue;
 
-	/* Create the ForeignScan node */
-	return make_foreignscan(tlist,
-							scan_clauses,
-							scan_relid,
-							NIL,	/* no expressions to evaluate */
-							NIL,	/* no private state either */
-							NIL);   /* no custom tlist */
+		if (entry->context)
+			redisFree(entry->context);
+		entry->context = NULL;
+		entry->in_use = false;
+	}
 }
 
-/*
- * fileExplainForeignScan
- *		Produce extra output for EXPLAIN
- */
 static void
-redisExplainForeignScan(ForeignScanState *node, ExplainState *es)
+redisSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg)
 {
-	redisReply *reply;
-
-	RedisFdwExecutionState *festate = 
-		(RedisFdwExecutionState *) node->fdw_state;
+	HASH_SEQ_STATUS scan;
+	RedisConnCacheEntry *entry;
 
-#ifdef DEBUG
-	elog(NOTICE, "redisExplainForeignScan");
-#endif
-
-	if (!es->costs)
+	if (event != SUBXACT_EVENT_ABORT_SUB && event != SUBXACT_EVENT_COMMIT_SUB)
 		return;
 
-	/* 
-	 * Execute a query to get the table size 
-	 *
-	 * See above for more details.
-	 */
-   
-	if (festate->keyset)
-	{ 
-		reply = redisCommand(festate->context, "SCARD %s", festate->keyset);
-	}
-	else
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (RedisConnCacheEntry *) hash_seq_search(&scan)))
 	{
-		reply = redisCommand(festate->context, "DBSIZE");
-	}
+		if (!entry->in_use || entry->subid != mySubid)
+			continue;
 
-	if (!reply)
-	{
-		redisFree(festate->context);
-		ereport(ERROR,
-				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-		 errmsg("failed to get the table size: %d", festate->context->err)
-				 ));
+		/* on commit, the parent takes over the connection */
+		if (event == SUBXACT_EVENT_COMMIT_SUB)
+		{
+			entry->subid = parentSubid;
+			continue;
+		}
+
+		if (entry->context)
+			redisFree(entry->context);
+		entry->context = NULL;
+		entry->in_use = false;
 	}
+}
+
+/*
+ * redisGetTableConnection
+ *		Get the connection a scan of the table starts with. That's the
+ *		server's, except that in a cluster a singleton key or keyset is read
+ *		from the master that holds it.
+ */
+static redisContext *
+redisGetTableConnection(RedisTableOptions table_options)
+{
+	char	   *key = table_options->singleton_key ?
+		table_options->singleton_key : table_options->keyset;
 
-	if (reply->type == REDIS_REPLY_ERROR)
+	if (table_options->cluster && key != NULL)
 	{
-		char	   *err = pstrdup(reply->str);
+		RedisSlotMapEntry *map = redisGetSlotMap(table_options);
+		int			node = map->slots[redisKeySlot(key, strlen(key))];
 
-		ereport(ERROR,
-				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-				 errmsg("failed to get the table size: %s", err)
-				 ));
+		if (node >= 0)
+			return redisGetNodeConnection(table_options,
+										  map->addresses[node],
+										  map->ports[node]);
 	}
 
-	ExplainPropertyLong("Foreign Redis Table Size", 
-						festate->keyprefix ? reply->integer / 20 : 
-						reply->integer, 
-						es);
+	return redisGetConnection(table_options);
+}
 
-	freeReplyObject(reply);
+/*
+ * redisGetNodeConnection
+ *		Get a connection to one node of a cluster.
+ */
+static redisContext *
+redisGetNodeConnection(RedisTableOptions table_options,
+					   const char *address, int port)
+{
+	redisTableOptions node_options = *table_options;
+
+	node_options.address = (char *) address;
+	node_options.port = port;
+
+	return redisGetConnection(&node_options);
 }
 
 /*
- * redisBeginForeignScan
- *		Initiate access to the database
+ * redisGetSlotMap
+ *		Get the slot map of a cluster server, reading it with CLUSTER SLOTS
+ *		from the server's address if we don't have a valid one.
  */
-static void
-redisBeginForeignScan(ForeignScanState *node, int eflags)
+static RedisSlotMapEntry *
+redisGetSlotMap(RedisTableOptions table_options)
 {
-	redisTableOptions table_options;
+	RedisSlotMapEntry *entry;
 	redisContext *context;
 	redisReply *reply;
-	char	   *qual_key = NULL;
-	char	   *qual_value = NULL;
-	bool		pushdown = false;
-	RedisFdwExecutionState *festate;
-	struct timeval timeout = {1, 500000};
+	bool		found;
+	size_t		i;
+	int			node;
 
-#ifdef DEBUG
-	elog(NOTICE, "BeginForeignScan");
-#endif
+	if (SlotMapHash == NULL)
+	{
+		HASHCTL		ctl;
 
-	table_options.address = NULL;
-	table_options.port = 0;
-	table_options.password = NULL;
-	table_options.database = 0;
-	table_options.keyprefix = NULL;
-    table_options.keyset = NULL;
-	table_options.singleton_key = NULL;
-    table_options.table_type = PG_REDIS_SCALAR_TABLE;
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(RedisSlotMapEntry);
+		ctl.hcxt = CacheMemoryContext;
+		SlotMapHash = hash_create("redis_fdw slot maps", 8, &ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
+		CacheRegisterSyscacheCallback(FOREIGNSERVEROID,
+									  redisInvalidateSlotMaps, (Datum) 0);
+	}
 
-   /* Fetch options  */
-   redisGetOptions(RelationGetRelid(node->ss.ss_currentRelation), 
-				   &table_options);
+	entry = hash_search(SlotMapHash, &table_options->serverid,
+						HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->valid = false;
+		entry->nnodes = 0;
+		entry->addresses = NULL;
+		entry->ports = NULL;
+	}
 
-	/* Connect to the server */
-	context = redisConnectWithTimeout(table_options.address, 
-									  table_options.port, timeout);
+	if (entry->valid)
+		return entry;
 
-	if (context->err)
+	context = redisGetConnection(table_options);
+	reply = redisCommand(context, "CLUSTER SLOTS");
+
+	if (!reply || reply->type != REDIS_REPLY_ARRAY)
 	{
-		redisFree(context);
+		char	   *err = pstrdup(reply && reply->type == REDIS_REPLY_ERROR ?
+								  reply->str : context->errstr);
+
+		if (reply)
+			freeReplyObject(reply);
 		ereport(ERROR,
 				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-				 errmsg("failed to connect to Redis: %s", context->errstr)
+				 errmsg("failed to get the cluster slots: %s", err)
 				 ));
 	}
 
-	/* Authenticate */
-	if (table_options.password)
+	/* start again from scratch */
+	for (node = 0; node < entry->nnodes; node++)
+		pfree(entry->addresses[node]);
+	if (entry->addresses)
+	{
+		pfree(entry->addresses);
+		pfree(entry->ports);
+	}
+	entry->nnodes = 0;
+	entry->addresses = MemoryContextAlloc(CacheMemoryContext,
+										  sizeof(char *) * (reply->elements + 1));
+	entry->ports = MemoryContextAlloc(CacheMemoryContext,
+									  sizeof(int) * (reply->elements + 1));
+	for (i = 0; i < CLUSTER_SLOTS; i++)
+		entry->slots[i] = -1;
+
+	/* each range is its first and last slot, its master, then replicas */
+	for (i = 0; i < reply->elements; i++)
 	{
-		reply = redisCommand(context, "AUTH %s", table_options.password);
+		redisReply *range = reply->element[i];
+		redisReply *master;
+		const char *address;
+		int			port;
+		long long	slot;
 
-		if (!reply)
+		if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 ||
+			range->element[2]->type != REDIS_REPLY_ARRAY ||
+			range->element[2]->elements < 2)
+			continue;
+
+		master = range->element[2];
+
+		/* an empty address means the node we asked */
+		address = master->element[0]->len > 0 ?
+			master->element[0]->str : table_options->address;
+		port = (int) master->element[1]->integer;
+
+		for (node = 0; node < entry->nnodes; node++)
 		{
-			redisFree(context);
-			ereport(ERROR,
-					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-			   errmsg("failed to authenticate to redis: %s", context->errstr)
-					 ));
+			if (entry->ports[node] == port &&
+				strcmp(entry->addresses[node], address) == 0)
+				break;
+		}
+		if (node == entry->nnodes)
+		{
+			entry->addresses[node] = MemoryContextStrdup(CacheMemoryContext,
+														 address);
+			entry->ports[node] = port;
+			entry->nnodes++;
 		}
 
-		freeReplyObject(reply);
+		for (slot = Max(range->element[0]->integer, 0);
+			 slot <= range->element[1]->integer && slot < CLUSTER_SLOTS;
+			 slot++)
+			entry->slots[slot] = node;
 	}
 
-	/* Select the appropriate database */
-	reply = redisCommand(context, "SELECT %d", table_options.database);
+	freeReplyObject(reply);
+	redisReleaseConnection(context);
 
-	if (!reply)
-	{
-		redisFree(context);
+	if (entry->nnodes == 0)
 		ereport(ERROR,
 				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-				 errmsg("failed to select database %d: %s", 
-						table_options.database, context->errstr)
+				 errmsg("no slots are assigned in the Redis Cluster")
 				 ));
-	}
 
-	if (reply->type == REDIS_REPLY_ERROR)
-	{
-		char	   *err = pstrdup(reply->str);
+	entry->hashvalue = GetSysCacheHashValue1(FOREIGNSERVEROID,
+							  ObjectIdGetDatum(table_options->serverid));
+	entry->valid = true;
 
-		ereport(ERROR,
-				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-				 errmsg("failed to select database %d: %s", 
-						table_options.database, err)
-				 ));
+	return entry;
+}
+
+/*
+ * Syscache callback: a foreign server's options have changed, so its slot
+ * map should be read again, perhaps from a different node.
+ */
+static void
+redisInvalidateSlotMaps(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS scan;
+	RedisSlotMapEntry *entry;
+
+	hash_seq_init(&scan, SlotMapHash);
+	while ((entry = (RedisSlotMapEntry *) hash_seq_search(&scan)))
+	{
+		if (hashvalue == 0 || entry->hashvalue == hashvalue)
+			entry->valid = false;
 	}
+}
 
-	freeReplyObject(reply);
+/*
+ * redisKeySlot
+ *		Work out the cluster slot of a key. It's the CRC16 of the key, or of
+ *		what's in the first {...} of it if that isn't empty, modulo 16384.
+ */
+static int
+redisKeySlot(const char *key, size_t keylen)
+{
+	const char *open = memchr(key, '{', keylen);
+	uint16		crc = 0;
+	size_t		i;
+	int			bit;
 
-	/* See if we've got a qual we can push down */
-	if (node->ss.ps.plan->qual)
+	if (open != NULL)
 	{
-		ListCell   *lc;
+		size_t		start = open - key + 1;
+		const char *close = memchr(key + start, '}', keylen - start);
 
-		foreach(lc, node->ss.ps.qual)
+		if (close != NULL && close > key + start)
 		{
-			/* Only the first qual can be pushed down to Redis */
-			ExprState  *state = lfirst(lc);
-
-			redisGetQual((Node *) state->expr, 
-						 node->ss.ss_currentRelation->rd_att, 
-						 &qual_key, &qual_value, &pushdown);
-			if (pushdown)
-				break;
+			keylen = close - (key + start);
+			key += start;
 		}
 	}
 
-	/* Stash away the state info we have already */
-	festate = (RedisFdwExecutionState *) palloc(sizeof(RedisFdwExecutionState));
-	node->fdw_state = (void *) festate;
-	festate->context = context;
-	festate->reply = NULL;
-	festate->row = 0;
-	festate->address = table_options.address;
-	festate->port = table_options.port;
-	festate->keyprefix = table_options.keyprefix;
-	festate->keyset = table_options.keyset;
-	festate->singleton_key = table_options.singleton_key;
-	festate->table_type = table_options.table_type;
-	festate->cursor_id = NULL;
-	festate->cursor_search_string = NULL;
-	
-	festate->qual_value = pushdown ? qual_value : NULL;
+	/* CRC16-CCITT (XMODEM), as Redis uses */
+	for (i = 0; i < keylen; i++)
+	{
+		crc ^= (uint16) ((unsigned char) key[i] << 8);
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (uint16) ((crc << 1) ^ 0x1021) :
+				(uint16) (crc << 1);
+	}
 
-	/* OK, we connected. If this is an EXPLAIN, bail out now */
-	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+	return crc & (CLUSTER_SLOTS - 1);
+}
+
+
+static void
+redisGetForeignRelSize(PlannerInfo *root,
+					   RelOptInfo *baserel,
+					   Oid foreigntableid)
+{
+	RedisFdwPlanState *fdw_private;
+	redisTableOptions table_options;
+
+	redisContext *context;
+	double		rows;
+	int			width;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisGetForeignRelSize");
+#endif
+
+	/*
+	 * Fetch options. Get everything so we don't need to re-fetch it later in
+	 * planning.
+	 */
+	fdw_private = (RedisFdwPlanState *) palloc(sizeof(RedisFdwPlanState));
+	baserel->fdw_private = (void *) fdw_private;
+
+	redisGetOptions(foreigntableid, &table_options);
+	fdw_private->svr_address = table_options.address;
+	fdw_private->svr_password = table_options.password;
+	fdw_private->svr_port = table_options.port;
+	fdw_private->svr_database = table_options.database;
+	fdw_private->singleton = (table_options.singleton_key != NULL);
+	fdw_private->keyprefix = table_options.keyprefix;
+
+	/*
+	 * The executor always puts the key in the first column, so that's the
+	 * only one we can treat as the key, and only if it's called key.
+	 */
+	fdw_private->key_attnum = get_attnum(foreigntableid, "key");
+	if (fdw_private->key_attnum != 1)
+		fdw_private->key_attnum = InvalidAttrNumber;
+	fdw_private->table_type = table_options.table_type;
+	fdw_private->lex_range = table_options.lex_range;
+
+	/* a singleton scalar is just one row, no need to ask */
+	if (table_options.singleton_key &&
+		table_options.table_type == PG_REDIS_SCALAR_TABLE)
+	{
+		baserel->rows = 1;
 		return;
+	}
 
-	/* Execute the query */
-	if (festate->singleton_key)
+	/*
+	 * If the table has been analyzed, go with that unless we've been told to
+	 * ask the server; the column widths come from the statistics too.
+	 * Otherwise use the cached estimate if it's fresh enough, so we don't
+	 * have to touch the network at all while planning.
+	 */
+	if (!table_options.use_remote_estimate && baserel->pages > 0)
 	{
+		rows = baserel->tuples;
+		width = 0;
+	}
+	else if (!redisLookupEstimate(foreigntableid, &table_options,
+								  &rows, &width))
+	{
+		context = redisGetTableConnection(&table_options);
+		redisEstimateRelSize(context, &table_options, &rows, &width);
+		redisReleaseConnection(context);
 
-	  /*
-	   * We're not using cursors for now for singleton key tables.
-	   * The theory is that we don't expect them to be so large
-	   * in normal use that we would get any significant benefit from
-	   * doing so, and in any case scanning them in a single step is not
-	   * going to tie things up like scannoing the whole Redis database
-	   * could.
-	   */
+		redisStoreEstimate(foreigntableid, &table_options, rows, width);
+	}
 
-		switch (table_options.table_type)
+	baserel->tuples = rows;
+	baserel->rows = clamp_row_est(rows *
+								  clauselist_selectivity(root,
+												baserel->baserestrictinfo,
+														 0,
+														 JOIN_INNER,
+														 NULL));
+	if (width > 0)
+		baserel->width = width;
+}
+
+/*
+ * redisEstimateRelSize
+ *		Ask the server for the number of rows in the table and, if
+ *		use_remote_estimate is set, their average width.
+ *
+ * The row count comes from DBSIZE, SCARD on the keyset, or the cardinality
+ * of the singleton key. For a keyprefix table we can't count the matching
+ * keys without scanning them all, so without use_remote_estimate we use a
+ * fairly dubious heuristic, and with it we take a bounded SCAN sample of the
+ * keyspace and scale DBSIZE by the fraction of keys that match the prefix.
+ * The average width is taken from MEMORY USAGE (or STRLEN, for servers
+ * that don't have it) on a sample of the keys.
+ */
+static void
+redisEstimateRelSize(redisContext *context, RedisTableOptions table_options,
+					 double *rows, int *width)
+{
+	redisReply *reply = NULL;
+	char	  **sample = NULL;
+	size_t	   *samplelen = NULL;
+	int			nsample = 0;
+	double		keywidth = 0;
+	int			i;
+
+	*width = 0;
+
+	/* Execute a query to get the table size */
+	if (table_options->singleton_key)
+	{
+		switch (table_options->table_type)
 		{
-			case PG_REDIS_SCALAR_TABLE:
-				reply = redisCommand(context,"GET %s",festate->singleton_key);
-				break;
 			case PG_REDIS_HASH_TABLE:
-				/* the singleton case where a qual pushdown makes most sense */
-				if (qual_value && pushdown)
-					reply = redisCommand(context,"HGET %s %s",festate->singleton_key, qual_value);
-				else
-					reply = redisCommand(context,"HGETALL %s",festate->singleton_key);
+				reply = redisCommand(context, "HLEN %s",table_options->singleton_key);
 				break;
 			case PG_REDIS_LIST_TABLE:
-				reply = redisCommand(context, "LRANGE %s 0 -1",table_options.singleton_key);
+				reply = redisCommand(context, "LLEN %s",table_options->singleton_key);
 				break;
 			case PG_REDIS_SET_TABLE:
-				reply = redisCommand(context, "SMEMBERS %s",table_options.singleton_key);
+				reply = redisCommand(context, "SCARD %s",table_options->singleton_key);
 				break;
 			case PG_REDIS_ZSET_TABLE:
-				reply = redisCommand(context, "ZRANGE %s 0 -1 WITHSCORES",table_options.singleton_key);
+				reply = redisCommand(context, "ZCARD %s",table_options->singleton_key);
 				break;
 			default:
 				;
 		}
 	}
-	else if (qual_value && pushdown)
+	else if (table_options->keyset)
+	{ 
+		reply = redisCommand(context,"SCARD %s",table_options->keyset);
+	}
+	else
 	{
-		/* 
-		 * if we have a qual, make sure it's a member of the keyset or has
-		 * the right prefix if either of these options is specified.
-		 *
-		 * If not set row to -1 to indicate failure
-		 */
-		if (festate->keyset)
-		{
-			redisReply *sreply;
-			sreply = redisCommand(context, "SISMEMBER %s %s", 
-								  festate->keyset, qual_value);
-			if(!sreply)
-			{
-				redisFree(festate->context);
-				ereport(ERROR,
-						(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
-						 errmsg("failed to list keys: %s", context->errstr)
-							));
-			}
-			if (sreply->type == REDIS_REPLY_ERROR)
-			{
-				char	   *err = pstrdup(sreply->str);
-				
-				freeReplyObject(sreply);
-				ereport(ERROR,
-						(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-						 errmsg("failed to list keys: %s", err)
-							));
-
-			}
-			
-			if (sreply->integer != 1)
-				festate->row =-1;
+		reply = redisCommand(context, "DBSIZE");
+	}
 
-		}
-		else if (festate->keyprefix)
-		{
-			if (strncmp(qual_value, festate->keyprefix, 
-						strlen(festate->keyprefix)) != 0)
-				festate->row = -1;
-		}
+	if (!reply)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+				 errmsg("failed to get the database size: %s", context->errstr)
+				 ));
+	}
 
-		/*
-		 * For a qual we don't want to scan at all,
-		 * just check that the key exists. We do this
-		 * check in adddition to the keyset/keyprefix checks,
-		 * is any, so we know the item is really there.
-		 */
+	*rows = reply->integer;
+	freeReplyObject(reply);
 
-		reply = redisCommand(context,"EXISTS %s",qual_value);
-		if (reply->integer == 0)
-			festate->row = -1;
+	/* DBSIZE is just one master's share of a cluster */
+	if (table_options->cluster && !table_options->singleton_key &&
+		!table_options->keyset)
+		*rows *= redisGetSlotMap(table_options)->nnodes;
 
+	if (!table_options->use_remote_estimate)
+	{
+		if (table_options->keyprefix)
+			*rows = *rows / 20;
+		return;
 	}
-	else
+
+	/* Pick some keys to sample */
+	sample = palloc(sizeof(char *) * ESTIMATE_SAMPLE_KEYS);
+	samplelen = palloc(sizeof(size_t) * ESTIMATE_SAMPLE_KEYS);
+
+	if (table_options->singleton_key)
+	{
+		sample[nsample] = table_options->singleton_key;
+		samplelen[nsample++] = strlen(table_options->singleton_key);
+	}
+	else if (table_options->keyset)
 	{
-		/* no qual - do a cursor scan */
-		if (festate->keyset)
+		reply = redisCommand(context, "SRANDMEMBER %s %d",
+							 table_options->keyset, ESTIMATE_SAMPLE_KEYS);
+
+		if (reply && reply->type == REDIS_REPLY_ARRAY)
 		{
-			festate->cursor_search_string = "SSCAN %s %s" COUNT;
-			reply = redisCommand(context, festate->cursor_search_string,
-								 festate->keyset, ZERO);
+			for (i = 0; i < reply->elements && nsample < ESTIMATE_SAMPLE_KEYS; i++)
+			{
+				sample[nsample] = pnstrdup(reply->element[i]->str,
+										   reply->element[i]->len);
+				samplelen[nsample++] = reply->element[i]->len;
+			}
 		}
-		else if (festate->keyprefix)
+		if (reply)
+			freeReplyObject(reply);
+	}
+	else
+	{
+		char	   *cursor_id = ZERO;
+		double		seen = 0;
+		double		matched = 0;
+		int			prefixlen = 0;
+		int			page;
+
+		if (table_options->keyprefix)
+			prefixlen = strlen(table_options->keyprefix);
+
+		for (page = 0; page < ESTIMATE_SAMPLE_PAGES; page++)
 		{
-			festate->cursor_search_string = "SCAN %s MATCH %s*" COUNT;
-			reply = redisCommand(context, festate->cursor_search_string,
-								 ZERO, festate->keyprefix);
+			redisReply *keys;
+
+			reply = redisCommand(context, "SCAN %s" COUNT, cursor_id,
+								 DEFAULT_SCAN_COUNT);
+
+			if (!reply || reply->type != REDIS_REPLY_ARRAY ||
+				reply->elements != 2)
+			{
+				if (reply)
+					freeReplyObject(reply);
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+						 errmsg("failed to sample keys: %s", context->errstr)
+						 ));
+			}
+
+			keys = reply->element[1];
+			for (i = 0; i < keys->elements; i++)
+			{
+				redisReply *key = keys->element[i];
+
+				seen++;
+				if (prefixlen > 0 &&
+					(key->len < prefixlen ||
+					 strncmp(key->str, table_options->keyprefix,
+							 prefixlen) != 0))
+					continue;
+
+				matched++;
+				if (nsample < ESTIMATE_SAMPLE_KEYS)
+				{
+					sample[nsample] = pnstrdup(key->str, key->len);
+					samplelen[nsample++] = key->len;
+				}
+			}
+
+			cursor_id = pstrdup(reply->element[0]->str);
+			freeReplyObject(reply);
+
+			/* a cursor of 0 means we've seen the whole keyspace */
+			if (strcmp(cursor_id, ZERO) == 0)
+				break;
 		}
-		else
+
+		if (prefixlen > 0)
 		{
-			festate->cursor_search_string = "SCAN %s" COUNT;
-			reply = redisCommand(context, festate->cursor_search_string, ZERO);
+			if (strcmp(cursor_id, ZERO) == 0)
+				*rows = matched;
+			else if (seen > 0)
+				*rows = *rows * (matched / seen);
 		}
 	}
 
-	if (!reply)
+	if (nsample == 0)
+		return;
+
+	/*
+	 * Measure the sampled values. MEMORY USAGE needs Redis 4.0, so if the
+	 * server doesn't know it, fall back on STRLEN, which works for scalars.
+	 */
+	for (i = 0; i < nsample; i++)
 	{
-		redisFree(festate->context);
-		ereport(ERROR,
-				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
-				 errmsg("failed to list keys: %s", context->errstr)
-				 ));
+		redisAppendCommand(context, "MEMORY USAGE %b", sample[i], samplelen[i]);
+		keywidth += samplelen[i];
+	}
+	keywidth /= nsample;
+
+	if (!redisSampleWidths(context, nsample, width) &&
+		table_options->table_type == PG_REDIS_SCALAR_TABLE &&
+		!table_options->singleton_key)
+	{
+		for (i = 0; i < nsample; i++)
+			redisAppendCommand(context, "STRLEN %b", sample[i], samplelen[i]);
+		redisSampleWidths(context, nsample, width);
 	}
-	else if (reply->type == REDIS_REPLY_ERROR)
+
+	/* a singleton's elements share the memory used by the one key */
+	if (table_options->singleton_key && *rows > 0)
+		*width = *width / *rows;
+	else if (*width > 0)
+		*width += (int) keywidth;
+}
+
+/*
+ * Read the nsample integer replies to pipelined size commands and set width
+ * to their average. Returns false if the server didn't give us any.
+ */
+static bool
+redisSampleWidths(redisContext *context, int nsample, int *width)
+{
+	double		total = 0;
+	int			nvalid = 0;
+	int			i;
+
+	for (i = 0; i < nsample; i++)
 	{
-		char	   *err = pstrdup(reply->str);
-		
+		redisReply *reply = NULL;
+
+		if (redisGetReply(context, (void **) &reply) != REDIS_OK || !reply)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+					 errmsg("failed to sample values: %s", context->errstr)
+					 ));
+
+		if (reply->type == REDIS_REPLY_INTEGER && reply->integer > 0)
+		{
+			total += reply->integer;
+			nvalid++;
+		}
 		freeReplyObject(reply);
-		ereport(ERROR,
-				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-				 errmsg("failed somehow: %s", err)
-					));
 	}
 
-	/* Store the additional state info */
-	festate->attinmeta = 
-		TupleDescGetAttInMetadata(node->ss.ss_currentRelation->rd_att);
+	if (nvalid == 0)
+		return false;
 
-	if (festate->singleton_key)
+	*width = (int) (total / nvalid);
+	return true;
+}
+
+/*
+ * Estimate cache
+ *
+ * Row count and width estimates are kept per foreign table for
+ * estimate_cache_ttl seconds, so planning doesn't have to touch the network
+ * every time. They are dropped when the options of the table or of any
+ * server change, and each is only used with the options it was made with,
+ * in case we haven't been told of the change yet.
+ */
+static uint32
+redisEstimateOptionsHash(RedisTableOptions table_options)
+{
+	StringInfoData buf;
+	uint32		hash;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%u %s %d %d %d %c%s %c%s %c%s %d %d %d",
+					 table_options->serverid,
+					 table_options->address ? table_options->address : "",
+					 table_options->port,
+					 table_options->database,
+					 (int) table_options->table_type,
+					 table_options->keyprefix ? '+' : '-',
+					 table_options->keyprefix ? table_options->keyprefix : "",
+					 table_options->keyset ? '+' : '-',
+					 table_options->keyset ? table_options->keyset : "",
+					 table_options->singleton_key ? '+' : '-',
+					 table_options->singleton_key ?
+					 table_options->singleton_key : "",
+					 (int) table_options->strict_existence,
+					 (int) table_options->use_remote_estimate,
+					 (int) table_options->cluster);
+
+	hash = DatumGetUInt32(hash_any((unsigned char *) buf.data, buf.len));
+	pfree(buf.data);
+
+	return hash;
+}
+
+static bool
+redisLookupEstimate(Oid foreigntableid, RedisTableOptions table_options,
+					double *rows, int *width)
+{
+	RedisEstimateEntry *entry;
+	int			ttl = table_options->estimate_ttl;
+
+	if (EstimateHash == NULL || ttl == 0)
+		return false;
+
+	entry = hash_search(EstimateHash, &foreigntableid, HASH_FIND, NULL);
+
+	if (!entry ||
+		entry->optionshash != redisEstimateOptionsHash(table_options) ||
+		TimestampDifferenceExceeds(entry->stamp, GetCurrentTimestamp(),
+								   ttl * 1000))
+		return false;
+
+	*rows = entry->rows;
+	*width = entry->width;
+	return true;
+}
+
+static void
+redisStoreEstimate(Oid foreigntableid, RedisTableOptions table_options,
+				   double rows, int width)
+{
+	RedisEstimateEntry *entry;
+
+	if (EstimateHash == NULL)
 	{
-		festate->reply = reply;
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(RedisEstimateEntry);
+		ctl.hcxt = CacheMemoryContext;
+		EstimateHash = hash_create("redis_fdw estimates", 16, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		CacheRegisterSyscacheCallback(FOREIGNTABLEREL,
+									  redisInvalidateEstimates, (Datum) 0);
+		CacheRegisterSyscacheCallback(FOREIGNSERVEROID,
+									  redisInvalidateEstimates, (Datum) 0);
+	}
+
+	entry = hash_search(EstimateHash, &foreigntableid, HASH_ENTER, NULL);
+	entry->hashvalue = GetSysCacheHashValue1(FOREIGNTABLEREL,
+											 ObjectIdGetDatum(foreigntableid));
+	entry->optionshash = redisEstimateOptionsHash(table_options);
+	entry->stamp = GetCurrentTimestamp();
+	entry->rows = rows;
+	entry->width = width;
+}
+
+static void
+redisInvalidateEstimates(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS scan;
+	RedisEstimateEntry *entry;
+
+	/* we don't know which tables use a server, so a server change drops all */
+	hash_seq_init(&scan, EstimateHash);
+	while ((entry = (RedisEstimateEntry *) hash_seq_search(&scan)))
+	{
+		if (cacheid == FOREIGNSERVEROID || hashvalue == 0 ||
+			entry->hashvalue == hashvalue)
+			hash_search(EstimateHash, &entry->relid, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * redisGetForeignPaths
+ *		Create possible access paths for a scan on the foreign table
+ *
+ *		The basic path simply returns all records in redis. If the key can be
+ *		taken from another relation we also make parameterized paths, which
+ *		look up just that key for each outer row.
+ */
+static void
+redisGetForeignPaths(PlannerInfo *root,
+					 RelOptInfo *baserel,
+					 Oid foreigntableid)
+{
+	RedisFdwPlanState *fdw_private = baserel->fdw_private;
+
+	Cost		startup_cost,
+				total_cost;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisGetForeignPaths");
+#endif
+
+	if (strcmp(fdw_private->svr_address, "127.0.0.1") == 0 ||
+		strcmp(fdw_private->svr_address, "localhost") == 0)
+		startup_cost = 10;
+	else
+		startup_cost = 25;
+
+	total_cost = startup_cost + baserel->rows;
+
+
+	/* Create a ForeignPath node for the whole table */
+	add_path(baserel, (Path *)
+			 create_foreignscan_path(root, baserel,
+									 baserel->rows,
+									 startup_cost,
+									 total_cost,
+									 NIL,		/* no pathkeys */
+									 NULL,		/* no outer rel either */
+									 NIL));		/* no fdw_private data */
+
+	/*
+	 * A singleton zset comes back in order of score, or the reverse if we
+	 * ask for it, so if that's what the query wants there's no need for a
+	 * sort. The path's fdw_private says whether to read it backwards.
+	 */
+	if (fdw_private->singleton &&
+		fdw_private->table_type == PG_REDIS_ZSET_TABLE)
+	{
+		int			order = redisZsetScoreOrder(root, baserel);
+
+		if (order != 0)
+			add_path(baserel, (Path *)
+					 create_foreignscan_path(root, baserel,
+											 baserel->rows,
+											 startup_cost,
+											 total_cost,
+											 root->query_pathkeys,
+											 NULL,
+											 list_make1(makeInteger(order < 0))));
 	}
-	else if (festate->row > -1 && festate->qual_value == NULL)
+
+	/*
+	 * Now look for join clauses of the form key = outer.col. Each lookup is
+	 * a round trip, which is what the startup cost stands for, so a nested
+	 * loop over a few outer rows is a lot cheaper than reading the whole
+	 * keyspace. A singleton table has no keys to look up.
+	 */
+	if (!fdw_private->singleton &&
+		fdw_private->key_attnum != InvalidAttrNumber)
 	{
-		redisReply *cursor = reply->element[0];
+		List	   *clauses = NIL;
+		List	   *ppi_list = NIL;
+		ListCell   *lc;
 
-		if (cursor->type == REDIS_REPLY_STRING)
+		foreach(lc, baserel->joininfo)
 		{
-			if (cursor->len == 1 && cursor->str[0] == '0')
-				festate->cursor_id = NULL;
-			else
-				festate->cursor_id = pstrdup(cursor->str);
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+			if (join_clause_is_movable_to(rinfo, baserel) &&
+				redisGetParamKeyExpr(baserel, fdw_private->key_attnum,
+									 rinfo->clause) != NULL)
+				clauses = lappend(clauses, rinfo);
 		}
-		else
+
+		/* key = outer.col may also be implied by an equivalence class */
+		if (baserel->has_eclass_joins)
+			clauses = list_concat(clauses,
+								  generate_implied_equalities_for_column(root,
+																		 baserel,
+													   redisKeyMemberMatches,
+															 fdw_private,
+											  baserel->lateral_referencers));
+
+		foreach(lc, clauses)
 		{
-			ereport(ERROR,
-					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-					 errmsg("wrong reply type %d", cursor->type)
-						));
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+			Relids		required_outer;
+			ParamPathInfo *param_info;
+
+			if (redisGetParamKeyExpr(baserel, fdw_private->key_attnum,
+									 rinfo->clause) == NULL)
+				continue;
+
+			required_outer = bms_union(rinfo->clause_relids,
+									   baserel->lateral_relids);
+			required_outer = bms_del_member(required_outer, baserel->relid);
+			if (bms_is_empty(required_outer))
+				continue;
+
+			/* several clauses can give us the same parameterization */
+			param_info = get_baserel_parampathinfo(root, baserel,
+												   required_outer);
+			if (list_member_ptr(ppi_list, param_info))
+				continue;
+			ppi_list = lappend(ppi_list, param_info);
+
+			add_path(baserel, (Path *)
+					 create_foreignscan_path(root, baserel,
+											 param_info->ppi_rows,
+											 startup_cost,
+											 startup_cost +
+											 param_info->ppi_rows,
+											 NIL,		/* no pathkeys */
+											 required_outer,
+											 NIL));		/* no fdw_private */
 		}
-
-		/* for cursors, this is the list of elements */
-		festate->reply = reply->element[1];
 	}
 }
 
 /*
- * redisIterateForeignScan
- *		Read next record from the data file and store it into the
- *		ScanTupleSlot as a virtual tuple
- *
- * We have now spearated this into two streams of logic - one
- * for singleton key tables and one for multi-key tables.
+ * redisIsKeyVar
+ *		Is this the key column of the foreign table, or whichever column
+ *		key_attnum is?
  */
+static bool
+redisIsKeyVar(Node *node, RelOptInfo *baserel, AttrNumber key_attnum)
+{
+	Var		   *var = (Var *) node;
 
-static TupleTableSlot *
-redisIterateForeignScan(ForeignScanState *node)
+	return (node != NULL && IsA(node, Var) &&
+			var->varno == baserel->relid &&
+			var->varlevelsup == 0 &&
+			var->varattno == key_attnum);
+}
+
+/*
+ * redisGetParamKeyExpr
+ *		If the clause is key = expr, where expr doesn't depend on the foreign
+ *		table, return expr, so that it can be evaluated to get the key to
+ *		look up. Otherwise return NULL.
+ */
+static Expr *
+redisGetParamKeyExpr(RelOptInfo *baserel, AttrNumber key_attnum, Expr *clause)
 {
-	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
-	if (festate->singleton_key)
-		return redisIterateForeignScanSingleton(node);
+	OpExpr	   *op = (OpExpr *) clause;
+	Node	   *left,
+			   *right;
+	Node	   *other;
+
+	if (!IsA(clause, OpExpr) || list_length(op->args) != 2)
+		return NULL;
+
+	/* clauses made from equivalence classes don't have opfuncid set yet */
+	if (op->opno != TextEqualOperator)
+		return NULL;
+
+	left = linitial(op->args);
+	right = lsecond(op->args);
+
+	if (redisIsKeyVar(left, baserel, key_attnum))
+		other = right;
+	else if (redisIsKeyVar(right, baserel, key_attnum))
+		other = left;
 	else
-		return redisIterateForeignScanMulti(node);
+		return NULL;
+
+	if (bms_is_member(baserel->relid, pull_varnos(other)) ||
+		contain_volatile_functions(other))
+		return NULL;
+
+	return (Expr *) other;
+}
+
+/*
+ * redisKeyMemberMatches
+ *		generate_implied_equalities_for_column callback, matching the key
+ *		column.
+ */
+static bool
+redisKeyMemberMatches(PlannerInfo *root, RelOptInfo *baserel,
+					  EquivalenceClass *ec, EquivalenceMember *em,
+					  void *arg)
+{
+	RedisFdwPlanState *fdw_private = (RedisFdwPlanState *) arg;
+
+	return redisIsKeyVar((Node *) em->em_expr, baserel,
+						 fdw_private->key_attnum);
+}
+
+/*
+ * redisZsetScoreOrder
+ *		Does the query want a singleton zset table sorted by score? Returns 1
+ *		for ascending order, -1 for descending, and 0 if it wants some other
+ *		order or none.
+ *
+ * Scores are never null, so it doesn't matter where the nulls would go.
+ */
+static int
+redisZsetScoreOrder(PlannerInfo *root, RelOptInfo *baserel)
+{
+	PathKey    *pathkey;
+	ListCell   *lc;
+
+	if (list_length(root->query_pathkeys) != 1)
+		return 0;
+
+	pathkey = (PathKey *) linitial(root->query_pathkeys);
+	if (pathkey->pk_eclass->ec_has_volatile)
+		return 0;
+
+	foreach(lc, pathkey->pk_eclass->ec_members)
+	{
+		EquivalenceMember *em = (EquivalenceMember *) lfirst(lc);
+		Oid			type = exprType((Node *) em->em_expr);
+
+		if (!redisIsKeyVar((Node *) em->em_expr, baserel, ZSET_SCORE_ATTNUM) ||
+			!redisIsScoreType(type) ||
+			pathkey->pk_opfamily != redisBtreeFamily(type))
+			continue;
+
+		if (pathkey->pk_strategy == BTLessStrategyNumber)
+			return 1;
+		if (pathkey->pk_strategy == BTGreaterStrategyNumber)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * redisIsScoreType
+ *		Does a score column of this type sort and compare the way Redis does
+ *		the double it comes from? A real doesn't, as it's rounded.
+ */
+static bool
+redisIsScoreType(Oid type)
+{
+	return (type == FLOAT8OID || type == NUMERICOID ||
+			type == INT8OID || type == INT4OID || type == INT2OID);
+}
+
+/*
+ * redisBtreeFamily
+ *		The operator family of the type's default btree opclass, if any.
+ */
+static Oid
+redisBtreeFamily(Oid type)
+{
+	Oid			opclass = GetDefaultOpClass(type, BTREE_AM_OID);
+
+	if (!OidIsValid(opclass))
+		return InvalidOid;
+
+	return get_opclass_family(opclass);
+}
+
+/*
+ * redisGetRangeBound
+ *		If the clause compares the column with a constant, using a btree
+ *		operator of the column type's default family, return the constant,
+ *		set *strategy to say how the column compares with it, and *type to
+ *		the type it's compared as. Otherwise return NULL.
+ */
+static Const *
+redisGetRangeBound(RelOptInfo *baserel, AttrNumber attnum, Expr *clause,
+				   int *strategy, Oid *type)
+{
+	OpExpr	   *op = (OpExpr *) clause;
+	Node	   *left,
+			   *right;
+	Oid			opno;
+	Oid			opfamily;
+
+	if (!IsA(clause, OpExpr) || list_length(op->args) != 2)
+		return NULL;
+
+	left = linitial(op->args);
+	right = lsecond(op->args);
+	opno = op->opno;
+
+	/* turn const < column round */
+	if (IsA(left, Const))
+	{
+		Node	   *tmp = left;
+
+		left = right;
+		right = tmp;
+		opno = get_commutator(opno);
+		if (!OidIsValid(opno))
+			return NULL;
+	}
+
+	if (!IsA(right, Const) || ((Const *) right)->constisnull)
+		return NULL;
+
+	/* a varchar column is compared as text */
+	*type = exprType(left);
+	opfamily = redisBtreeFamily(*type);
+	if (IsA(left, RelabelType))
+		left = (Node *) ((RelabelType *) left)->arg;
+
+	if (!redisIsKeyVar(left, baserel, attnum) || !OidIsValid(opfamily))
+		return NULL;
+
+	*strategy = get_op_opfamily_strategy(opno, opfamily);
+	if (*strategy == 0)
+		return NULL;
+
+	return (Const *) right;
+}
+
+/*
+ * redisGetZsetRange
+ *		Work out how to read a singleton zset table, for the fdw_private of
+ *		the plan: the range of scores the quals allow, or, with lex_range,
+ *		the range of values, and whether to read it backwards. The quals
+ *		the range enforces exactly are added to *exact, and needn't be
+ *		checked again.
+ *
+ * Otherwise the range only has to hold every row the quals would pass.
+ * That matters for a numeric score column, because Redis compares doubles
+ * while we compare the decimal it prints, which may differ in the last
+ * place, so we widen the bounds by a double's precision either way.
+ *
+ * ZRANGEBYLEX only makes sense if every member has the same score, which
+ * only the user can tell us, and orders by bytes, which only matches the C
+ * collation. It doesn't return the scores either, so we only use it if
+ * they're not wanted.
+ */
+static List *
+redisGetZsetRange(RelOptInfo *baserel, RedisFdwPlanState *fdw_private,
+				  List *scan_clauses, List *retrieved_attrs, bool reverse,
+				  List **exact)
+{
+	redis_zset_range range = PG_REDIS_ZSET_RANK;
+	double		score_min = -HUGE_VAL;
+	double		score_max = HUGE_VAL;
+	bool		min_excl = false;
+	bool		max_excl = false;
+	char	   *lex_min = NULL;
+	char	   *lex_max = NULL;
+	List	   *lex_quals = NIL;
+	ListCell   *lc;
+
+	*exact = NIL;
+
+	foreach(lc, scan_clauses)
+	{
+		Expr	   *clause = (Expr *) lfirst(lc);
+		Const	   *bound;
+		int			strategy;
+		Oid			type;
+		bool		lower,
+					upper,
+					excl;
+
+		bound = redisGetRangeBound(baserel, ZSET_SCORE_ATTNUM, clause,
+								   &strategy, &type);
+		if (bound != NULL)
+		{
+			double		d;
+
+			if (!redisIsScoreType(type))
+				continue;
+
+			d = redisConstDouble(bound);
+			if (isnan(d))
+				continue;
+
+			lower = (strategy >= BTEqualStrategyNumber);
+			upper = (strategy <= BTEqualStrategyNumber);
+			excl = (strategy == BTLessStrategyNumber ||
+					strategy == BTGreaterStrategyNumber);
+
+			if (type == NUMERICOID)
+				excl = false;
+
+			if (lower)
+			{
+				double		b = (type == NUMERICOID) ?
+					nextafter(d, -HUGE_VAL) : d;
+
+				if (b > score_min || (b == score_min && excl))
+				{
+					score_min = b;
+					min_excl = excl;
+				}
+			}
+			if (upper)
+			{
+				double		b = (type == NUMERICOID) ?
+					nextafter(d, HUGE_VAL) : d;
+
+				if (b < score_max || (b == score_max && excl))
+				{
+					score_max = b;
+					max_excl = excl;
+				}
+			}
+			range = PG_REDIS_ZSET_SCORE;
+
+			/*
+			 * A double or integer column compares just as Redis does, as
+			 * long as the constant is exactly a double.
+			 */
+			if (type != NUMERICOID &&
+				(bound->consttype == FLOAT8OID || bound->consttype == FLOAT4OID ||
+				 fabs(d) <= 9007199254740992.0))
+				*exact = lappend(*exact, clause);
+			continue;
+		}
+
+		if (!fdw_private->lex_range || reverse ||
+			list_member_int(retrieved_attrs, ZSET_SCORE_ATTNUM))
+			continue;
+
+		bound = redisGetRangeBound(baserel, ZSET_VALUE_ATTNUM, clause,
+								   &strategy, &type);
+		if (bound != NULL && type == TEXTOID &&
+			lc_collate_is_c(((OpExpr *) clause)->inputcollid))
+		{
+			Oid			typoutput;
+			bool		typisvarlena;
+			char	   *value;
+
+			getTypeOutputInfo(bound->consttype, &typoutput, &typisvarlena);
+			value = OidOutputFunctionCall(typoutput, bound->constvalue);
+
+			lower = (strategy >= BTEqualStrategyNumber);
+			upper = (strategy <= BTEqualStrategyNumber);
+			excl = (strategy == BTLessStrategyNumber ||
+					strategy == BTGreaterStrategyNumber);
+
+			/* the bounds are kept as Redis takes them, ( or [ and the value */
+			if (lower &&
+				(lex_min == NULL || strcmp(value, lex_min + 1) > 0 ||
+				 (strcmp(value, lex_min + 1) == 0 && excl)))
+				lex_min = psprintf("%c%s", excl ? '(' : '[', value);
+			if (upper &&
+				(lex_max == NULL || strcmp(value, lex_max + 1) < 0 ||
+				 (strcmp(value, lex_max + 1) == 0 && excl)))
+				lex_max = psprintf("%c%s", excl ? '(' : '[', value);
+			lex_quals = lappend(lex_quals, clause);
+		}
+	}
+
+	if (range == PG_REDIS_ZSET_SCORE)
+		return list_make4(makeInteger(range),
+						  makeString(psprintf("%s%.17g", min_excl ? "(" : "",
+											  score_min)),
+						  makeString(psprintf("%s%.17g", max_excl ? "(" : "",
+											  score_max)),
+						  makeInteger(reverse));
+
+	if (lex_min != NULL || lex_max != NULL)
+	{
+		*exact = lex_quals;
+		return list_make4(makeInteger(PG_REDIS_ZSET_LEX),
+						  makeString(lex_min ? lex_min : "-"),
+						  makeString(lex_max ? lex_max : "+"),
+						  makeInteger(false));
+	}
+
+	if (reverse)
+		return list_make4(makeInteger(PG_REDIS_ZSET_RANK),
+						  makeString(""), makeString(""),
+						  makeInteger(true));
+
+	return NIL;
+}
+
+/*
+ * redisConstDouble
+ *		The value of a numeric constant as a double, as Redis would read it.
+ */
+static double
+redisConstDouble(Const *bound)
+{
+	Oid			typoutput;
+	bool		typisvarlena;
+
+	if (bound->consttype == FLOAT8OID)
+		return DatumGetFloat8(bound->constvalue);
+	if (bound->consttype == FLOAT4OID)
+		return DatumGetFloat4(bound->constvalue);
+
+	getTypeOutputInfo(bound->consttype, &typoutput, &typisvarlena);
+	return strtod(OidOutputFunctionCall(typoutput, bound->constvalue), NULL);
+}
+
+/*
+ * redisGetKeyPattern
+ *		If the clause is key LIKE 'const' or key ~ 'const', return the Redis
+ *		glob pattern for it, or NULL if it can't be expressed as one. *lossy
+ *		is set if the pattern can match keys the clause doesn't, in which case
+ *		the clause still has to be checked locally.
+ *
+ * The glob is also what we MATCH in place of tablekeyprefix, so we only use
+ * it if it can only match keys that start with the prefix.
+ */
+static char *
+redisGetKeyPattern(RelOptInfo *baserel, AttrNumber key_attnum,
+				   const char *keyprefix, Expr *clause, bool *lossy)
+{
+	OpExpr	   *op = (OpExpr *) clause;
+	Node	   *right;
+	char	   *pattern;
+	char	   *glob;
+
+	if (!IsA(clause, OpExpr) || list_length(op->args) != 2)
+		return NULL;
+
+	if (!redisIsKeyVar(linitial(op->args), baserel, key_attnum))
+		return NULL;
+
+	right = lsecond(op->args);
+	if (!IsA(right, Const) || ((Const *) right)->constisnull)
+		return NULL;
+
+	pattern = TextDatumGetCString(((Const *) right)->constvalue);
+
+	if (op->opno == OID_TEXT_LIKE_OP)
+		glob = redisLikeToGlob(pattern, lossy);
+	else if (op->opno == OID_TEXT_REGEXEQ_OP)
+		glob = redisRegexToGlob(pattern, lossy);
+	else
+		return NULL;
+
+	if (glob != NULL && keyprefix != NULL &&
+		!redisGlobHasPrefix(glob, keyprefix))
+		return NULL;
+
+	return glob;
+}
+
+/*
+ * redisAppendGlobChar
+ *		Append a literal character to a glob pattern, escaping it if it's one
+ *		that Redis treats specially.
+ */
+static void
+redisAppendGlobChar(StringInfo buf, char c)
+{
+	if (c == '*' || c == '?' || c == '[' || c == ']' || c == '\\')
+		appendStringInfoChar(buf, '\\');
+	appendStringInfoChar(buf, c);
+}
+
+/*
+ * redisLikeToGlob
+ *		Translate a LIKE pattern to a glob.
+ *
+ * This is exact, except that ? matches a single byte where _ matches a
+ * character, so with a multibyte encoding we have to use * instead.
+ */
+static char *
+redisLikeToGlob(const char *pattern, bool *lossy)
+{
+	StringInfoData buf;
+	const char *p;
+
+	initStringInfo(&buf);
+	*lossy = false;
+
+	for (p = pattern; *p; p++)
+	{
+		switch (*p)
+		{
+			case '%':
+				appendStringInfoChar(&buf, '*');
+				break;
+			case '_':
+				if (pg_database_encoding_max_length() > 1)
+				{
+					appendStringInfoChar(&buf, '*');
+					*lossy = true;
+				}
+				else
+					appendStringInfoChar(&buf, '?');
+				break;
+			case '\\':
+				/* a trailing escape is an error, which LIKE can report */
+				if (p[1] == '\0')
+					return NULL;
+				p++;
+				redisAppendGlobChar(&buf, *p);
+				break;
+			default:
+				redisAppendGlobChar(&buf, *p);
+				break;
+		}
+	}
+
+	/* matching everything isn't worth passing along */
+	if (strcmp(buf.data, "*") == 0)
+		return NULL;
+
+	return buf.data;
+}
+
+/*
+ * redisRegexToGlob
+ *		Translate an anchored regular expression to a glob.
+ *
+ * We only go as far as the literal text after the ^, which becomes the
+ * prefix of the glob. If that's followed by nothing, .* or $ the glob is
+ * exact, otherwise it matches more than the regex does.
+ *
+ * That only holds if everything after the prefix can only narrow what the
+ * regex matches. An alternation can widen it, as in ^a|b, so we don't
+ * translate a regex with a | anywhere in it, even in brackets.
+ */
+static char *
+redisRegexToGlob(const char *pattern, bool *lossy)
+{
+	StringInfoData buf;
+	const char *p;
+
+	for (p = pattern; *p; p++)
+	{
+		if (*p == '|')
+			return NULL;
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+	}
+
+	p = pattern;
+	if (*p++ != '^')
+		return NULL;
+
+	initStringInfo(&buf);
+	*lossy = true;
+
+	for (;;)
+	{
+		int			len = buf.len;
+
+		if (*p == '\0' ||
+			strcmp(p, ".*") == 0 || strcmp(p, ".*$") == 0)
+		{
+			appendStringInfoChar(&buf, '*');
+			*lossy = false;
+			break;
+		}
+		else if (strcmp(p, "$") == 0)
+		{
+			*lossy = false;
+			break;
+		}
+		else if (*p == '\\' && p[1] != '\0' && !isalnum((unsigned char) p[1]))
+		{
+			/* an escaped punctuation character stands for itself */
+			redisAppendGlobChar(&buf, p[1]);
+			p += 2;
+		}
+		else if (*p != '\0' && strchr(".[]()*+?{}|^$\\", *p) == NULL)
+		{
+			redisAppendGlobChar(&buf, *p);
+			p++;
+		}
+		else
+		{
+			appendStringInfoChar(&buf, '*');
+			break;
+		}
+
+		/* a quantifier makes the character we just added optional */
+		if (*p == '*' || *p == '+' || *p == '?' || *p == '{')
+		{
+			buf.len = len;
+			buf.data[len] = '\0';
+			appendStringInfoChar(&buf, '*');
+			break;
+		}
+	}
+
+	/* a regex with no literal prefix would have us scan everything anyway */
+	if (buf.len == 0 || strcmp(buf.data, "*") == 0)
+		return NULL;
+
+	return buf.data;
+}
+
+/*
+ * redisGlobHasPrefix
+ *		Can the glob only match strings that start with prefix?
+ */
+static bool
+redisGlobHasPrefix(const char *glob, const char *prefix)
+{
+	const char *g = glob;
+	const char *p;
+
+	for (p = prefix; *p; p++)
+	{
+		if (*g == '*' || *g == '?' || *g == '[' || *g == '\0')
+			return false;
+		if (*g == '\\')
+			g++;
+		if (*g != *p)
+			return false;
+		g++;
+	}
+
+	return true;
+}
+
+/*
+ * redisIsKeyLookup
+ *		Is the clause one that the executor will use to look up keys directly
+ *		instead of scanning? See redisGetQual.
+ */
+static bool
+redisIsKeyLookup(RelOptInfo *baserel, AttrNumber key_attnum, Expr *clause)
+{
+	if (IsA(clause, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) clause;
+
+		return (op->useOr && op->opno == TextEqualOperator &&
+				redisIsKeyVar(linitial(op->args), baserel, key_attnum));
+	}
+
+	return redisGetParamKeyExpr(baserel, key_attnum, clause) != NULL;
+}
+
+static ForeignScan *
+redisGetForeignPlan(PlannerInfo *root,
+					RelOptInfo *baserel,
+					Oid foreigntableid,
+					ForeignPath *best_path,
+					List *tlist,
+					List *scan_clauses)
+{
+	RedisFdwPlanState *fdw_private = baserel->fdw_private;
+	Index		scan_relid = baserel->relid;
+	List	   *fdw_exprs = NIL;
+	char	   *key_pattern = NULL;
+	Bitmapset  *attrs_used = NULL;
+	List	   *retrieved_attrs;
+	List	   *zset_range = NIL;
+	List	   *exact = NIL;
+	List	   *limit_private = NIL;
+	int64		limit;
+	int64		offset;
+	AttrNumber	count_key = InvalidAttrNumber;
+	ListCell   *lc;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisGetForeignPlan");
+#endif
+
+	/*
+	 * If there's a key = expr clause we can evaluate at run time, such as
+	 * the join clause of a parameterized path or a comparison with a query
+	 * parameter, pass expr along so the executor can look up that key
+	 * instead of scanning. Constants are dealt with by the executor from the
+	 * quals themselves.
+	 */
+	if (!fdw_private->singleton &&
+		fdw_private->key_attnum != InvalidAttrNumber)
+	{
+		foreach(lc, scan_clauses)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+			Expr	   *expr;
+
+			if (rinfo->pseudoconstant)
+				continue;
+
+			expr = redisGetParamKeyExpr(baserel, fdw_private->key_attnum,
+										rinfo->clause);
+			if (expr != NULL && !IsA(expr, Const))
+			{
+				fdw_exprs = list_make1(expr);
+				break;
+			}
+		}
+	}
+
+	/*
+	 * See if there's a LIKE or anchored regex on the key that Redis can
+	 * MATCH while scanning. If the glob is exact, and the executor is going
+	 * to scan rather than look up keys, the clause needn't be checked again
+	 * here.
+	 */
+	if (!fdw_private->singleton &&
+		fdw_private->key_attnum != InvalidAttrNumber)
+	{
+		RestrictInfo *pattern_rinfo = NULL;
+		bool		lossy = true;
+		bool		lookup = (fdw_exprs != NIL);
+
+		foreach(lc, scan_clauses)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+			if (rinfo->pseudoconstant)
+				continue;
+
+			if (redisIsKeyLookup(baserel, fdw_private->key_attnum,
+								 rinfo->clause))
+				lookup = true;
+			else if (key_pattern == NULL)
+			{
+				key_pattern = redisGetKeyPattern(baserel,
+												 fdw_private->key_attnum,
+												 fdw_private->keyprefix,
+												 rinfo->clause, &lossy);
+				if (key_pattern != NULL)
+					pattern_rinfo = rinfo;
+			}
+		}
+
+		if (key_pattern != NULL && !lossy && !lookup)
+			scan_clauses = list_delete_ptr(list_copy(scan_clauses),
+										   pattern_rinfo);
+	}
+
+	/*
+	 * We have no native ability to evaluate restriction clauses, so we just
+	 * put all the scan_clauses into the plan node's qual list for the
+	 * executor to check.  So all we have to do here is strip RestrictInfo
+	 * nodes from the clauses and ignore pseudoconstants (which will be
+	 * handled elsewhere).
+	 */
+	scan_clauses = extract_actual_clauses(scan_clauses, false);
+
+	/*
+	 * Work out which columns have to be returned, so that if it's only the
+	 * key the executor doesn't need to fetch the values.
+	 */
+	pull_varattnos((Node *) baserel->reltargetlist, baserel->relid,
+				   &attrs_used);
+	pull_varattnos((Node *) scan_clauses, baserel->relid, &attrs_used);
+	retrieved_attrs = redisRetrievedAttrs(attrs_used, baserel->max_attr);
+
+	/* See which part of a singleton zset to read, and in what order */
+	if (fdw_private->singleton &&
+		fdw_private->table_type == PG_REDIS_ZSET_TABLE)
+	{
+		zset_range = redisGetZsetRange(baserel, fdw_private, scan_clauses,
+									   retrieved_attrs,
+									   best_path->fdw_private != NIL &&
+									   intVal(linitial(best_path->fdw_private)),
+									   &exact);
+		scan_clauses = list_difference_ptr(scan_clauses, exact);
+	}
+
+	/*
+	 * If nothing but the LIMIT stands between us and the query's result,
+	 * the executor can stop fetching once it has that many rows. The ones
+	 * the OFFSET skips needn't be fetched at all from a list or zset, as
+	 * those are read by position.
+	 */
+	limit = redisGetLimit(root, baserel, best_path, scan_clauses, &offset);
+	if (limit > 0)
+	{
+		if (!fdw_private->singleton ||
+			(fdw_private->table_type != PG_REDIS_LIST_TABLE &&
+			 fdw_private->table_type != PG_REDIS_ZSET_TABLE))
+			offset = 0;
+		limit_private = list_make2(makeInteger(limit), makeInteger(offset));
+	}
+
+	/* count(key) needs no more from the rows than count(*) does */
+	if (fdw_exprs == NIL)
+		count_key = redisGetCountKey(root, baserel, fdw_private->key_attnum,
+									 retrieved_attrs, scan_clauses);
+
+	/* Create the ForeignScan node */
+	return make_foreignscan(tlist,
+							scan_clauses,
+							scan_relid,
+							fdw_exprs,	/* key to look up, if any */
+							lappend(lappend(list_make4(makeString(key_pattern ?
+																  key_pattern : ""),
+													   retrieved_attrs,
+													   limit_private,
+													   zset_range),
+											makeInteger((long) baserel->tuples)),
+									makeInteger(count_key)),
+							NIL);   /* no custom tlist */
+}
+
+/*
+ * redisGetCountKey
+ *		If the key is the only column the scan returns, and the query only
+ *		uses it in count(key), return its attribute number. Otherwise
+ *		return InvalidAttrNumber.
+ *
+ * The key is never NULL, so count(key) counts the rows just as count(*)
+ * does, and the executor can have the server count them. The key has to be
+ * set in each row, but it needn't be the row's own.
+ */
+static AttrNumber
+redisGetCountKey(PlannerInfo *root, RelOptInfo *baserel, AttrNumber key_attnum,
+				 List *retrieved_attrs, List *local_quals)
+{
+	Query	   *parse = root->parse;
+	Var			key;
+
+	if (key_attnum == InvalidAttrNumber ||
+		list_length(retrieved_attrs) != 1 ||
+		linitial_int(retrieved_attrs) != key_attnum ||
+		local_quals != NIL ||
+		parse->commandType != CMD_SELECT ||
+		!bms_equal(root->all_baserels, baserel->relids) ||
+		!parse->hasAggs || parse->groupClause != NIL ||
+		parse->groupingSets != NIL || parse->hasWindowFuncs ||
+		parse->setOperations != NULL || parse->rowMarks != NIL)
+		return InvalidAttrNumber;
+
+	memset(&key, 0, sizeof(key));
+	key.varno = baserel->relid;
+	key.varattno = key_attnum;
+
+	if (redisCountKeyWalker((Node *) parse->targetList, &key) ||
+		redisCountKeyWalker(parse->havingQual, &key))
+		return InvalidAttrNumber;
+
+	return key_attnum;
+}
+
+/*
+ * redisCountKeyWalker
+ *		Is the key used anywhere but in a plain count(key)?
+ */
+static bool
+redisCountKeyWalker(Node *node, Var *key)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Aggref))
+	{
+		Aggref	   *aggref = (Aggref *) node;
+
+		if (aggref->aggfnoid == F_COUNT_ANY &&
+			aggref->agglevelsup == 0 &&
+			aggref->aggdistinct == NIL &&
+			aggref->aggfilter == NULL &&
+			list_length(aggref->args) == 1)
+		{
+			Var		   *var = (Var *) ((TargetEntry *) linitial(aggref->args))->expr;
+
+			if (IsA(var, Var) &&
+				var->varno == key->varno &&
+				var->varattno == key->varattno &&
+				var->varlevelsup == 0)
+				return false;
+		}
+	}
+	else if (IsA(node, Var))
+	{
+		Var		   *var = (Var *) node;
+
+		return (var->varno == key->varno && var->varlevelsup == 0);
+	}
+
+	return expression_tree_walker(node, redisCountKeyWalker, (void *) key);
+}
+
+/*
+ * redisGetLimit
+ *		If the query's LIMIT can be applied to the scan, return the number of
+ *		rows it needs, counting the OFFSET, and set *offset to how many of
+ *		those the Limit node throws away without looking at them, if we can
+ *		hand it empty rows for those instead. Otherwise return -1.
+ *
+ * That's only so if the scan is the whole query, and nothing between it and
+ * the Limit can need more rows than that: no joins, grouping, aggregates,
+ * set-returning functions, sort (unless the path is already in order) or
+ * quals left for the executor. The rows it throws away still go through
+ * the target list, so they can only be empty if that's just columns.
+ */
+static int64
+redisGetLimit(PlannerInfo *root, RelOptInfo *baserel, ForeignPath *best_path,
+			  List *local_quals, int64 *offset)
+{
+	Query	   *parse = root->parse;
+	Const	   *count = (Const *) parse->limitCount;
+	int64		limit;
+	ListCell   *lc;
+
+	*offset = 0;
+
+	if (parse->commandType != CMD_SELECT ||
+		!bms_equal(root->all_baserels, baserel->relids) ||
+		local_quals != NIL ||
+		parse->hasAggs || parse->groupClause != NIL ||
+		parse->groupingSets != NIL || parse->havingQual != NULL ||
+		parse->hasWindowFuncs || parse->distinctClause != NIL ||
+		parse->setOperations != NULL || parse->rowMarks != NIL ||
+		expression_returns_set((Node *) parse->targetList) ||
+		!pathkeys_contained_in(root->sort_pathkeys,
+							   best_path->path.pathkeys))
+		return -1;
+
+	/* the planner has folded LIMIT and OFFSET to constants if it can */
+	if (count == NULL || !IsA(count, Const) || count->constisnull ||
+		DatumGetInt64(count->constvalue) < 0)
+		return -1;
+
+	if (parse->limitOffset != NULL)
+	{
+		Const	   *skip = (Const *) parse->limitOffset;
+
+		if (!IsA(skip, Const))
+			return -1;
+		if (!skip->constisnull)
+			*offset = DatumGetInt64(skip->constvalue);
+		if (*offset < 0 ||
+			*offset > PG_INT64_MAX - DatumGetInt64(count->constvalue))
+			return -1;
+	}
+
+	limit = DatumGetInt64(count->constvalue) + *offset;
+
+	foreach(lc, parse->targetList)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		if (!IsA(tle->expr, Var) && !IsA(tle->expr, Const))
+			*offset = 0;
+	}
+
+	return limit;
+}
+
+/*
+ * redisRetrievedAttrs
+ *		List the attribute numbers in attrs_used, which is offset by
+ *		FirstLowInvalidHeapAttributeNumber as pull_varattnos makes it. A
+ *		whole-row reference means all of them.
+ */
+static List *
+redisRetrievedAttrs(Bitmapset *attrs_used, AttrNumber natts)
+{
+	List	   *retrieved_attrs = NIL;
+	bool		whole_row;
+	AttrNumber	attnum;
+
+	whole_row = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber,
+							  attrs_used);
+
+	for (attnum = 1; attnum <= natts; attnum++)
+	{
+		if (whole_row ||
+			bms_is_member(attnum - FirstLowInvalidHeapAttributeNumber,
+						  attrs_used))
+			retrieved_attrs = lappend_int(retrieved_attrs, attnum);
+	}
+
+	return retrieved_attrs;
+}
+
+/*
+ * fileExplainForeignScan
+ *		Produce extra output for EXPLAIN
+ */
+static void
+redisExplainForeignScan(ForeignScanState *node, ExplainState *es)
+{
+	RedisFdwExecutionState *festate = 
+		(RedisFdwExecutionState *) node->fdw_state;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisExplainForeignScan");
+#endif
+
+	if (es->verbose && festate->key_pattern)
+		ExplainPropertyText("Redis Key Pattern", festate->key_pattern, es);
+
+	if (es->verbose && festate->limit > 0)
+		ExplainPropertyLong("Redis Row Limit", (long) festate->limit, es);
+
+	if (es->verbose && festate->zset_range != PG_REDIS_ZSET_RANK)
+		ExplainPropertyText("Redis Zset Range",
+							festate->zset_reverse ?
+							psprintf("%s %s", festate->zset_max,
+									 festate->zset_min) :
+							psprintf("%s %s", festate->zset_min,
+									 festate->zset_max),
+							es);
+
+	/*
+	 * The table size is the planner's estimate, so that EXPLAIN doesn't
+	 * have to ask the server.
+	 */
+	if (es->costs)
+		ExplainPropertyLong("Foreign Redis Table Size",
+							intVal(list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+											FdwScanPrivateTableSize)),
+							es);
+
+	if (es->analyze)
+	{
+		ExplainPropertyLong("Redis Commands", festate->ncommands, es);
+		ExplainPropertyLong("Redis Round Trips", festate->nround_trips, es);
+		ExplainPropertyLong("Redis Pages", festate->npages, es);
+		ExplainPropertyLong("Redis Keys Skipped", festate->nskipped, es);
+		if (festate->seen_keys)
+			ExplainPropertyLong("Redis Duplicate Keys", festate->nduplicates,
+								es);
+		ExplainPropertyLong("Redis Reply Bytes", festate->nbytes, es);
+		if (es->timing)
+			ExplainPropertyFloat("Redis Wait Time",
+								 INSTR_TIME_GET_MILLISEC(festate->wait_time),
+								 3, es);
+	}
+}
+
+/*
+ * redisBeginForeignScan
+ *		Initiate access to the database
+ */
+static void
+redisBeginForeignScan(ForeignScanState *node, int eflags)
+{
+	redisTableOptions table_options;
+	redisContext *context;
+	redisReply *reply = NULL;
+	char	   *qual_key = NULL;
+	char	   *qual_value = NULL;
+	List	   *qual_values = NIL;
+	bool		pushdown = false;
+	List	   *zset_range;
+	List	   *limit_private;
+	RedisFdwExecutionState *festate;
+	ListCell   *lc;
+
+#ifdef DEBUG
+	elog(NOTICE, "BeginForeignScan");
+#endif
+
+   /* Fetch options  */
+   redisGetOptions(RelationGetRelid(node->ss.ss_currentRelation), 
+				   &table_options);
+
+	/* See if we've got a qual we can push down */
+	if (node->ss.ps.plan->qual)
+	{
+		foreach(lc, node->ss.ps.qual)
+		{
+			/* Only the first qual can be pushed down to Redis */
+			ExprState  *state = lfirst(lc);
+
+			redisGetQual((Node *) state->expr, 
+						 node->ss.ss_currentRelation->rd_att, 
+						 &qual_key, &qual_value, &qual_values, &pushdown);
+			if (pushdown)
+				break;
+		}
+	}
+
+	/* Stash away the state info we have already */
+	festate = (RedisFdwExecutionState *) palloc(sizeof(RedisFdwExecutionState));
+	node->fdw_state = (void *) festate;
+	festate->context = NULL;
+	festate->reply = NULL;
+	festate->row = 0;
+	festate->address = table_options.address;
+	festate->port = table_options.port;
+	festate->keyprefix = table_options.keyprefix;
+	festate->keyset = table_options.keyset;
+	festate->singleton_key = table_options.singleton_key;
+	festate->table_type = table_options.table_type;
+	festate->cursor_id = NULL;
+	festate->cursor_search_string = NULL;
+	festate->key_pattern = strVal(list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+										   FdwScanPrivateKeyPattern));
+	if (festate->key_pattern[0] == '\0')
+		festate->key_pattern = festate->keyprefix ?
+			psprintf("%s*", festate->keyprefix) : NULL;
+
+	/*
+	 * The key is the first column of a multi-key table, and everything else
+	 * comes from the value. If nothing else is wanted, don't fetch it.
+	 */
+	festate->fetch_values = false;
+	foreach(lc, (List *) list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+								  FdwScanPrivateRetrievedAttrs))
+	{
+		if (lfirst_int(lc) != 1)
+			festate->fetch_values = true;
+	}
+	festate->strict_existence = table_options.strict_existence;
+	festate->check_exists = false;
+	festate->singleton_stream = false;
+	festate->page_reply = NULL;
+	festate->window_start = 0;
+	festate->zset_range = PG_REDIS_ZSET_RANK;
+	festate->zset_min = NULL;
+	festate->zset_max = NULL;
+	festate->zset_reverse = false;
+	zset_range = (List *) list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+								   FdwScanPrivateZsetRange);
+	if (zset_range != NIL)
+	{
+		festate->zset_range = intVal(linitial(zset_range));
+		festate->zset_min = strVal(lsecond(zset_range));
+		festate->zset_max = strVal(lthird(zset_range));
+		festate->zset_reverse = intVal(lfourth(zset_range));
+	}
+	festate->limit = 0;
+	festate->offset = 0;
+	festate->nreturned = 0;
+	festate->count_rows = -1;
+	festate->count_key_attnum =
+		intVal(list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+						FdwScanPrivateCountKey));
+	festate->count_key = CStringGetTextDatum("");
+	limit_private = (List *) list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+									  FdwScanPrivateLimit);
+	if (limit_private != NIL)
+	{
+		festate->limit = intVal(linitial(limit_private));
+		festate->offset = intVal(lsecond(limit_private));
+	}
+	festate->scan_reply = NULL;
+	festate->keys = NULL;
+	festate->keylens = NULL;
+	festate->page_values = NULL;
+	festate->nkeys = 0;
+	festate->seen_keys = NULL;
+	festate->check_keyset = false;
+	festate->fetch_batch_size = table_options.fetch_batch_size;
+	festate->scan_count = table_options.scan_count;
+	festate->adaptive_scan_count = table_options.adaptive_scan_count;
+	festate->prefetch = table_options.prefetch;
+	festate->scan_script = false;
+	festate->prefetch_sent = false;
+	festate->prefetch_ahead = 0;
+	festate->prefetch_reply = NULL;
+	festate->batch_context = NULL;
+	festate->reply_cxt = NULL;
+	festate->text_replies = false;
+	festate->field_names = NULL;
+	festate->fetch_fields.nfields = 0;
+	festate->filter_fields.nfields = 0;
+	festate->filter_quals = NIL;
+	festate->filtering = false;
+	festate->batch_filter = NULL;
+	festate->cluster = false;
+	festate->keynodes = NULL;
+	festate->batch_reply = NULL;
+	festate->batch_member = NULL;
+	festate->batch_checked = false;
+	festate->batch_start = 0;
+	festate->batch_end = 0;
+	festate->pending = 0;
+	festate->param_exprs = NIL;
+	festate->param_pending = false;
+	festate->param_cxt = NULL;
+	festate->tuple_cxt = NULL;
+	festate->scan_cxt = NULL;
+	festate->instrument = (node->ss.ps.instrument != NULL);
+	festate->ncommands = 0;
+	festate->nround_trips = 0;
+	festate->npages = 0;
+	festate->nskipped = 0;
+	festate->nduplicates = 0;
+	festate->nbytes = 0;
+	INSTR_TIME_SET_ZERO(festate->wait_time);
+	
+	festate->qual_value = pushdown ? qual_value : NULL;
+
+	/* Store the additional state info */
+	festate->attinmeta = 
+		TupleDescGetAttInMetadata(node->ss.ss_currentRelation->rd_att);
+	festate->attkinds =
+		redisGetAttKinds(node->ss.ss_currentRelation->rd_att);
+
+	/* a hash's fields can have columns of their own */
+	if (!festate->singleton_key &&
+		festate->table_type == PG_REDIS_HASH_TABLE)
+		redisSetupHashFields(node, festate,
+							 (List *) list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+											   FdwScanPrivateRetrievedAttrs));
+
+	/* If this is an EXPLAIN, bail out now, without connecting */
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	/* Get a connection to the server, or the cluster node we start with */
+	context = redisGetTableConnection(&table_options);
+	festate->context = context;
+	festate->batch_context = context;
+
+	/*
+	 * We only prefetch from a single connection; a cluster's pages come
+	 * from all the masters at once anyway.
+	 */
+	if (table_options.cluster)
+	{
+		redisClusterBeginScan(festate, &table_options);
+		festate->prefetch = false;
+	}
+
+	festate->tuple_cxt = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+											   "redis_fdw tuple data",
+											   ALLOCSET_SMALL_MINSIZE,
+											   ALLOCSET_SMALL_INITSIZE,
+											   ALLOCSET_SMALL_MAXSIZE);
+
+	/*
+	 * The cursor and the current page have to outlive the tuples, as we
+	 * move on to the next page while iterating, in per-tuple memory.
+	 */
+	festate->scan_cxt = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+											  "redis_fdw scan state",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+	festate->reply_cxt = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+											   "redis_fdw batch replies",
+											   ALLOCSET_DEFAULT_MINSIZE,
+											   ALLOCSET_DEFAULT_INITSIZE,
+											   ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* Prepare the key expression, if the planner gave us one */
+	if (((ForeignScan *) node->ss.ps.plan)->fdw_exprs != NIL)
+	{
+		festate->param_exprs = (List *)
+			ExecInitExpr((Expr *) ((ForeignScan *) node->ss.ps.plan)->fdw_exprs,
+						 (PlanState *) node);
+		festate->param_cxt = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+												   "redis_fdw key lookup",
+												   ALLOCSET_SMALL_MINSIZE,
+												   ALLOCSET_SMALL_INITSIZE,
+												   ALLOCSET_SMALL_MAXSIZE);
+	}
+
+	/*
+	 * If no columns are wanted and there are no quals, as for count(*),
+	 * all we need is the number of rows, which the server may be able to
+	 * tell us straight away. The same goes for count(key).
+	 */
+	if (node->ss.ps.plan->qual == NIL &&
+		festate->param_exprs == NIL &&
+		(list_nth(((ForeignScan *) node->ss.ps.plan)->fdw_private,
+				  FdwScanPrivateRetrievedAttrs) == NIL ||
+		 festate->count_key_attnum != InvalidAttrNumber) &&
+		redisCountRows(festate, context))
+		return;
+
+	/* Execute the query */
+	if (festate->singleton_key &&
+		table_options.singleton_stream &&
+		table_options.table_type != PG_REDIS_SCALAR_TABLE &&
+		!(table_options.table_type == PG_REDIS_HASH_TABLE &&
+		  festate->qual_value))
+	{
+		/*
+		 * Read the collection a page at a time, so that a big one doesn't
+		 * have to be built into a single reply, or tie up the server while
+		 * it is. The first page is fetched when we start iterating.
+		 */
+		festate->singleton_stream = true;
+		festate->cursor_id = ZERO;
+		festate->window_start = festate->offset;
+	}
+	else if (festate->singleton_key)
+	{
+
+	  /*
+	   * Without singleton_stream, or for a single value, we get the whole
+	   * thing in one step.
+	   */
+
+		switch (table_options.table_type)
+		{
+			case PG_REDIS_SCALAR_TABLE:
+				reply = redisScanCommand(festate, context,"GET %s",festate->singleton_key);
+				break;
+			case PG_REDIS_HASH_TABLE:
+				/* the singleton case where a qual pushdown makes most sense */
+				if (festate->qual_value)
+					reply = redisScanCommand(festate, context,"HGET %s %s",festate->singleton_key, festate->qual_value);
+				else
+					reply = redisScanCommand(festate, context,"HGETALL %s",festate->singleton_key);
+				break;
+			case PG_REDIS_LIST_TABLE:
+				/* with a LIMIT, just the part of the list the query wants */
+				if (festate->limit > 0)
+					reply = redisScanCommand(festate, context,
+											 "LRANGE %s %lld %lld",
+											 table_options.singleton_key,
+											 (long long) festate->offset,
+											 (long long) festate->limit - 1);
+				else
+					reply = redisScanCommand(festate, context, "LRANGE %s 0 -1",table_options.singleton_key);
+				break;
+			case PG_REDIS_SET_TABLE:
+				reply = redisScanCommand(festate, context, "SMEMBERS %s",table_options.singleton_key);
+				break;
+			case PG_REDIS_ZSET_TABLE:
+				if (festate->limit > 0)
+					reply = redisZsetCommand(festate, context, festate->offset,
+											 festate->limit - festate->offset);
+				else
+					reply = redisZsetCommand(festate, context, 0, -1);
+				break;
+			default:
+				;
+		}
+
+		if (!reply)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+					 errmsg("failed to list keys: %s", context->errstr)
+					 ));
+		}
+		else if (reply->type == REDIS_REPLY_ERROR)
+		{
+			char	   *err = pstrdup(reply->str);
+
+			freeReplyObject(reply);
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+					 errmsg("failed somehow: %s", err)
+						));
+		}
+
+		festate->reply = reply;
+	}
+	else if (festate->param_exprs != NIL)
+	{
+		/*
+		 * The key depends on parameters that may not be set yet, so it is
+		 * evaluated when we start fetching, and again on each rescan.
+		 */
+		festate->param_pending = true;
+		festate->qual_value = NULL;
+	}
+	else if (pushdown)
+	{
+		/*
+		 * For a qual we don't want to scan at all, just look up the keys
+		 * we were given. They are fetched in pipelined batches like a
+		 * cursor page, along with the keyset membership checks.
+		 */
+		redisSetKeyList(festate, qual_values);
+		festate->qual_value = NULL;
+	}
+	else
+	{
+		/*
+		 * no key lookup - do a cursor scan. If we only want a few rows, and
+		 * every key will do, a page needn't be bigger than that.
+		 */
+		if (festate->limit > 0 && festate->key_pattern == NULL &&
+			festate->limit < festate->scan_count)
+			festate->scan_count = (int) festate->limit;
+
+		/*
+		 * The scan script reads the values as it goes, on the one server,
+		 * unless there are fields to check before fetching the rest.
+		 */
+		festate->scan_script = (table_options.scan_script &&
+								!festate->cluster &&
+								festate->filter_fields.nfields == 0);
+		if (table_options.scan_dedupe)
+			festate->seen_keys = redisCreateSeenKeys();
+		redisStartCursor(festate);
+		redisFetchNextPage(festate);
+	}
+}
+
+/*
+ * redisFetchSingletonPage
+ *		Get the next page of members of a singleton table's collection and
+ *		make festate->reply the array of them. Returns false if there are no
+ *		more.
+ *
+ * Hashes and sets are read with HSCAN and SSCAN, and lists and zsets with
+ * windows of LRANGE and ZRANGE, or its by-score or by-lex forms, which
+ * keeps zsets in order. The page size is scan_count either way.
+ * cursor_id is NULL once we've had the last page.
+ */
+static bool
+redisFetchSingletonPage(RedisFdwExecutionState *festate)
+{
+	redisReply *reply;
+	redisReply *elements;
+	int			count;
+	instr_time	start;
+
+	for (;;)
+	{
+		if (festate->page_reply)
+		{
+			freeReplyObject(festate->page_reply);
+			festate->page_reply = NULL;
+		}
+		festate->reply = NULL;
+		festate->row = 0;
+
+		if (festate->cursor_id == NULL)
+			return false;
+
+		/* windows are scan_count members long, or as many as we can use */
+		count = festate->scan_count;
+		if (festate->limit > 0)
+		{
+			int64		wanted;
+
+			if (festate->table_type == PG_REDIS_LIST_TABLE ||
+				festate->table_type == PG_REDIS_ZSET_TABLE)
+				wanted = festate->limit - festate->window_start;
+			else
+				wanted = Max(festate->limit - festate->nreturned, 1);
+
+			if (wanted <= 0)
+			{
+				festate->cursor_id = NULL;
+				return false;
+			}
+			if (wanted < count)
+				count = (int) wanted;
+		}
+		INSTR_TIME_SET_CURRENT(start);
+
+		switch (festate->table_type)
+		{
+			case PG_REDIS_HASH_TABLE:
+				reply = redisScanCommand(festate, festate->context,
+										 "HSCAN %s %s" COUNT,
+										 festate->singleton_key,
+										 festate->cursor_id, count);
+				break;
+			case PG_REDIS_SET_TABLE:
+				reply = redisScanCommand(festate, festate->context,
+										 "SSCAN %s %s" COUNT,
+										 festate->singleton_key,
+										 festate->cursor_id, count);
+				break;
+			case PG_REDIS_LIST_TABLE:
+				reply = redisScanCommand(festate, festate->context,
+										 "LRANGE %s %lld %lld",
+										 festate->singleton_key,
+										 festate->window_start,
+										 festate->window_start + count - 1);
+				break;
+			case PG_REDIS_ZSET_TABLE:
+				reply = redisZsetCommand(festate, festate->context,
+										 festate->window_start, count);
+				break;
+			default:
+				reply = NULL;
+				Assert(false);
+		}
+
+		if (!reply)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+					 errmsg("failed to list keys: %s",
+							festate->context->errstr)
+						));
+		}
+		else if (reply->type == REDIS_REPLY_ERROR)
+		{
+			char	   *err = pstrdup(reply->str);
+
+			freeReplyObject(reply);
+			if (festate->cluster && strncmp(err, "MOVED ", 6) == 0)
+				redisInvalidateSlotMaps((Datum) 0, FOREIGNSERVEROID, 0);
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+					 errmsg("failed somehow: %s", err)
+						));
+		}
+
+		festate->page_reply = reply;
+
+		if (festate->table_type == PG_REDIS_HASH_TABLE ||
+			festate->table_type == PG_REDIS_SET_TABLE)
+		{
+			redisReply *cursor = reply->element[0];
+
+			if (cursor->len == 1 && cursor->str[0] == '0')
+				festate->cursor_id = NULL;
+			else
+				festate->cursor_id = MemoryContextStrdup(festate->scan_cxt,
+														 cursor->str);
+			elements = reply->element[1];
+		}
+		else
+		{
+			/* a short window means we've reached the end */
+			long long	nmembers = reply->elements;
+
+			if (festate->table_type == PG_REDIS_ZSET_TABLE &&
+				festate->zset_range != PG_REDIS_ZSET_LEX)
+				nmembers /= 2;
+			if (nmembers < count)
+				festate->cursor_id = NULL;
+			else
+				festate->window_start += count;
+			elements = reply;
+		}
+
+		redisAdaptScanCount(festate, &start, elements);
+
+		/* a scan can give us an empty page that isn't the last one */
+		if (elements->elements > 0)
+		{
+			festate->reply = elements;
+			return true;
+		}
+	}
+}
+
+/*
+ * redisZsetCommand
+ *		Read count members of a singleton zset, from the start'th of those the
+ *		plan wants, or all of them if count is negative. The reply has the
+ *		score after each member, except for a lex range.
+ */
+static redisReply *
+redisZsetCommand(RedisFdwExecutionState *festate, redisContext *context,
+				 long long start, long long count)
+{
+	const char *key = festate->singleton_key;
+
+	switch (festate->zset_range)
+	{
+		case PG_REDIS_ZSET_SCORE:
+			if (festate->zset_reverse)
+				return count < 0 ?
+					redisScanCommand(festate, context,
+									 "ZREVRANGEBYSCORE %s %s %s WITHSCORES",
+									 key, festate->zset_max, festate->zset_min) :
+					redisScanCommand(festate, context,
+									 "ZREVRANGEBYSCORE %s %s %s WITHSCORES LIMIT %lld %lld",
+									 key, festate->zset_max, festate->zset_min,
+									 start, count);
+			return count < 0 ?
+				redisScanCommand(festate, context,
+								 "ZRANGEBYSCORE %s %s %s WITHSCORES",
+								 key, festate->zset_min, festate->zset_max) :
+				redisScanCommand(festate, context,
+								 "ZRANGEBYSCORE %s %s %s WITHSCORES LIMIT %lld %lld",
+								 key, festate->zset_min, festate->zset_max,
+								 start, count);
+		case PG_REDIS_ZSET_LEX:
+			return count < 0 ?
+				redisScanCommand(festate, context, "ZRANGEBYLEX %s %s %s",
+								 key, festate->zset_min, festate->zset_max) :
+				redisScanCommand(festate, context,
+								 "ZRANGEBYLEX %s %s %s LIMIT %lld %lld",
+								 key, festate->zset_min, festate->zset_max,
+								 start, count);
+		default:
+			return redisScanCommand(festate, context,
+									festate->zset_reverse ?
+									"ZREVRANGE %s %lld %lld WITHSCORES" :
+									"ZRANGE %s %lld %lld WITHSCORES",
+									key, start,
+									count < 0 ? -1 : start + count - 1);
+	}
+}
+
+/*
+ * redisCountRows
+ *		Get the number of rows in the table with a single command, if there
+ *		is one that counts them exactly, and set festate->count_rows to it.
+ *		Returns false if there isn't.
+ *
+ * For a singleton that's the length of the collection, or ZCOUNT or
+ * ZLEXCOUNT for a range of a zset. Otherwise it's the size of the keyset
+ * or the database, but only without strict_existence, as those count keys
+ * of any type, and without a prefix or pattern, as they count all the keys.
+ */
+static bool
+redisCountRows(RedisFdwExecutionState *festate, redisContext *context)
+{
+	redisReply *reply = NULL;
+
+	if (festate->singleton_key)
+	{
+		switch (festate->table_type)
+		{
+			case PG_REDIS_HASH_TABLE:
+				reply = redisScanCommand(festate, context, "HLEN %s",
+										 festate->singleton_key);
+				break;
+			case PG_REDIS_LIST_TABLE:
+				reply = redisScanCommand(festate, context, "LLEN %s",
+										 festate->singleton_key);
+				break;
+			case PG_REDIS_SET_TABLE:
+				reply = redisScanCommand(festate, context, "SCARD %s",
+										 festate->singleton_key);
+				break;
+			case PG_REDIS_ZSET_TABLE:
+				if (festate->zset_range == PG_REDIS_ZSET_SCORE)
+					reply = redisScanCommand(festate, context,
+											 "ZCOUNT %s %s %s",
+											 festate->singleton_key,
+											 festate->zset_min,
+											 festate->zset_max);
+				else if (festate->zset_range == PG_REDIS_ZSET_LEX)
+					reply = redisScanCommand(festate, context,
+											 "ZLEXCOUNT %s %s %s",
+											 festate->singleton_key,
+											 festate->zset_min,
+											 festate->zset_max);
+				else
+					reply = redisScanCommand(festate, context, "ZCARD %s",
+											 festate->singleton_key);
+				break;
+			default:
+				/* a scalar is one GET anyway */
+				return false;
+		}
+	}
+	else if (festate->strict_existence || festate->key_pattern)
+		return false;
+	else if (festate->keyset)
+		reply = redisScanCommand(festate, context, "SCARD %s", festate->keyset);
+	else if (festate->cluster)
+		return false;
+	else
+		reply = redisScanCommand(festate, context, "DBSIZE");
+
+	if (!reply)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+				 errmsg("failed to count the rows: %s", context->errstr)
+				 ));
+	}
+	else if (reply->type != REDIS_REPLY_INTEGER)
+	{
+		char	   *err = pstrdup(reply->type == REDIS_REPLY_ERROR ?
+								  reply->str : "unexpected reply");
+
+		freeReplyObject(reply);
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+				 errmsg("failed to count the rows: %s", err)
+				 ));
+	}
+
+	festate->count_rows = reply->integer;
+	freeReplyObject(reply);
+
+	return true;
+}
+
+/*
+ * redisAdaptScanCount
+ *		With adaptive_scan_count, pick the COUNT for the next page from how
+ *		the last one went.
+ *
+ * A page that took too long or was too big halves the count, so that we
+ * don't tie up the server or hold big replies. Otherwise a page that came
+ * back quickly, or with few of the members we asked for, as happens with
+ * a MATCH pattern over a sparse keyspace, doubles it, since a round trip
+ * costs about as much as the server's work on it.
+ */
+static void
+redisAdaptScanCount(RedisFdwExecutionState *festate, instr_time *start,
+					redisReply *elements)
+{
+	instr_time	elapsed;
+	uint64		usec;
+	size_t		bytes = 0;
+	long long	nkeys = elements->elements;
+	long long	i;
+
+	if (!festate->adaptive_scan_count)
+		return;
+
+	/* the scan script's values count towards the size of the page */
+	if (festate->scan_script)
+		nkeys /= 2;
+
+	/*
+	 * A prefetched page spent most of its time waiting for us rather than
+	 * the server, so we don't know how long it took; go by its size alone.
+	 */
+	if (start != NULL)
+	{
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, *start);
+		usec = INSTR_TIME_GET_MICROSEC(elapsed);
+	}
+	else
+		usec = SCAN_TARGET_USEC;
+
+	for (i = 0; i < elements->elements; i++)
+		bytes += redisReplyBytes(elements->element[i]);
+
+	if (usec > SCAN_TARGET_USEC || bytes > SCAN_TARGET_BYTES)
+		festate->scan_count = Max(festate->scan_count / 2, MIN_SCAN_COUNT);
+	else if (usec < SCAN_TARGET_USEC / 4 ||
+			 nkeys < festate->scan_count / 4)
+		festate->scan_count = Min(festate->scan_count * 2, MAX_SCAN_COUNT);
+}
+
+/*
+ * redisStartCursor
+ *		Set up a cursor over the keyset or the keyspace; the first page is
+ *		fetched by redisFetchNextPage.
+ */
+static void
+redisStartCursor(RedisFdwExecutionState *festate)
+{
+	if (festate->keyset && festate->key_pattern)
+		festate->cursor_search_string = "SSCAN %s %s MATCH %s" COUNT;
+	else if (festate->keyset)
+		festate->cursor_search_string = "SSCAN %s %s" COUNT;
+	else if (festate->key_pattern)
+		festate->cursor_search_string = "SCAN %s MATCH %s" COUNT;
+	else
+		festate->cursor_search_string = "SCAN %s" COUNT;
+
+	festate->cursor_id = ZERO;
+
+	/* a new scan can return any key again */
+	if (festate->seen_keys)
+		redisResetSeenKeys(festate->seen_keys);
+
+	if (festate->cluster)
+	{
+		int			node;
+
+		for (node = 0; node < festate->nmasters; node++)
+			festate->node_cursors[node] = ZERO;
+	}
+}
+
+/*
+ * redisFetchNextPage
+ *		Get the next page of keys from the cursor and make it current.
+ */
+static void
+redisFetchNextPage(RedisFdwExecutionState *festate)
+{
+	redisReply *creply;
+	redisReply *cursor;
+	redisReply *elements;
+	long long	i;
+	instr_time	start;
+	bool		prefetched = festate->prefetch_sent;
+
+	Assert(festate->cursor_id != NULL);
+
+	/* a cluster's keyspace is scanned on all the masters at once */
+	if (festate->cluster && festate->keyset == NULL)
+	{
+		redisClusterFetchNextPage(festate);
+		return;
+	}
+
+	if (prefetched)
+		creply = redisGetPrefetchedPage(festate);
+	else
+	{
+		INSTR_TIME_SET_CURRENT(start);
+		redisSendScan(festate);
+		if (redisScanReply(festate, festate->context, &creply) != REDIS_OK)
+			creply = NULL;
+	}
+
+	/*
+	 * The server has lost the scan script, or never had it from us, so
+	 * load it and ask again. There's nothing else on the connection, as
+	 * the values come with the page.
+	 */
+	if (creply && festate->scan_script &&
+		creply->type == REDIS_REPLY_ERROR &&
+		strncmp(creply->str, "NOSCRIPT", 8) == 0)
+	{
+		freeReplyObject(creply);
+		redisLoadScanScript(festate);
+
+		prefetched = false;
+		INSTR_TIME_SET_CURRENT(start);
+		redisSendScan(festate);
+		if (redisScanReply(festate, festate->context, &creply) != REDIS_OK)
+			creply = NULL;
+	}
+
+	if (!creply)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+				 errmsg("failed to list keys: %s",
+						festate->context->errstr)
+					));
+	}
+	else if (creply->type == REDIS_REPLY_ERROR)
+	{
+		char	   *err = pstrdup(creply->str);
+
+		freeReplyObject(creply);
+
+		/* the keyset has moved, so the next query should look again */
+		if (festate->cluster && strncmp(err, "MOVED ", 6) == 0)
+			redisInvalidateSlotMaps((Datum) 0, FOREIGNSERVEROID, 0);
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+				 errmsg("failed somehow: %s", err)
+					));
+	}
+
+	cursor  = creply->element[0];
+
+	if (cursor->type == REDIS_REPLY_STRING)
+	{
+		if (cursor->len == 1 && cursor->str[0] == '0')
+			festate->cursor_id = NULL;
+		else
+			festate->cursor_id = MemoryContextStrdup(festate->scan_cxt,
+													 cursor->str);
+	}
+	else
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+				 errmsg("wrong reply type %d", cursor->type)
+					));
+	}
+
+	/* the previous page and its last batch are all used up */
+	if (festate->scan_reply)
+		freeReplyObject(festate->scan_reply);
+	festate->batch_reply = NULL;
+	festate->batch_start = 0;
+	festate->batch_end = 0;
+
+	/* for cursors, the second element is the list of keys */
+	festate->scan_reply = creply;
+	elements = creply->element[1];
+	festate->npages++;
+
+	redisAdaptScanCount(festate, prefetched ? NULL : &start, elements);
+
+	if (festate->keys)
+	{
+		pfree(festate->keys);
+		pfree(festate->keylens);
+	}
+	if (festate->page_values)
+		pfree(festate->page_values);
+	festate->keys = MemoryContextAlloc(festate->scan_cxt, sizeof(char *) *
+									   (elements->elements + 1));
+	festate->keylens = MemoryContextAlloc(festate->scan_cxt, sizeof(size_t) *
+										  (elements->elements + 1));
+	festate->page_values = NULL;
+
+	/* the scan script sends each key followed by its value */
+	if (festate->scan_script)
+		festate->page_values = MemoryContextAlloc(festate->scan_cxt,
+												  sizeof(redisReply *) *
+												  (elements->elements / 2 + 1));
+
+	festate->nkeys = 0;
+	for (i = 0; i < elements->elements; i += festate->scan_script ? 2 : 1)
+	{
+		festate->keys[festate->nkeys] = elements->element[i]->str;
+		festate->keylens[festate->nkeys] = elements->element[i]->len;
+		if (festate->scan_script)
+			festate->page_values[festate->nkeys] = elements->element[i + 1];
+		festate->nkeys++;
+	}
+	festate->row = 0;
+
+	if (festate->seen_keys)
+		redisDedupePage(festate, false);
+
+	/* the members of a cluster's keyset can be on any node */
+	if (festate->cluster)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(festate->scan_cxt);
+
+		redisClusterRoutePage(festate);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* the cursor only gives us keys that were there when it reached them */
+	festate->check_exists = festate->strict_existence;
+
+	/*
+	 * Now that we know where the cursor goes next, ask for the next page, so
+	 * that the server works on it while we return this one. Its reply comes
+	 * back ahead of those for the value batches we're about to send.
+	 */
+	if (festate->prefetch && festate->cursor_id != NULL &&
+		!(festate->limit > 0 &&
+		  festate->nreturned + festate->nkeys >= festate->limit))
+	{
+		int			done = 0;
+
+		redisSendScan(festate);
+		festate->prefetch_sent = true;
+		festate->prefetch_ahead = festate->pending;
+
+		while (!done)
+		{
+			if (redisBufferWrite(festate->context, &done) != REDIS_OK)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+						 errmsg("failed to send SCAN: %s",
+								festate->context->errstr)
+						 ));
+		}
+	}
+}
+
+/*
+ * redisSendScan
+ *		Queue the command for the next page of the cursor. It's sent when we
+ *		next read a reply or flush the connection.
+ */
+static void
+redisSendScan(RedisFdwExecutionState *festate)
+{
+	int			res;
+
+	if (festate->scan_script)
+	{
+		res = redisAppendScanScript(festate);
+	}
+	else if (festate->keyset && festate->key_pattern)
+	{
+		res = redisAppendCommand(festate->context,
+								 festate->cursor_search_string,
+								 festate->keyset, festate->cursor_id,
+								 festate->key_pattern, festate->scan_count);
+	}
+	else if (festate->keyset)
+	{
+		res = redisAppendCommand(festate->context,
+								 festate->cursor_search_string,
+								 festate->keyset, festate->cursor_id,
+								 festate->scan_count);
+	}
+	else if (festate->key_pattern)
+	{
+		res = redisAppendCommand(festate->context,
+								 festate->cursor_search_string,
+								 festate->cursor_id, festate->key_pattern,
+								 festate->scan_count);
+	}
+	else
+	{
+		res = redisAppendCommand(festate->context,
+								 festate->cursor_search_string,
+								 festate->cursor_id, festate->scan_count);
+	}
+
+	if (res != REDIS_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_OUT_OF_MEMORY),
+				 errmsg("failed to queue SCAN: %s",
+						festate->context->errstr)
+				 ));
+}
+
+/*
+ * redisGetPrefetchedPage
+ *		Get the reply to the SCAN sent ahead of time, waiting for it if it
+ *		hasn't arrived yet.
+ */
+static redisReply *
+redisGetPrefetchedPage(RedisFdwExecutionState *festate)
+{
+	redisReply *reply;
+
+	Assert(festate->prefetch_sent);
+
+	/* throw away any replies due first, which nobody wants any more */
+	while (festate->prefetch_reply == NULL && festate->prefetch_ahead > 0)
+		(void) redisGetPendingReply(festate);
+
+	reply = festate->prefetch_reply;
+	if (reply == NULL &&
+		redisScanReply(festate, festate->context, &reply) != REDIS_OK)
+		reply = NULL;
+
+	festate->prefetch_sent = false;
+	festate->prefetch_reply = NULL;
+
+	return reply;
+}
+
+/*
+ * redisPollPrefetch
+ *		Read whatever has arrived for the prefetched page without waiting,
+ *		and keep the reply if it's all there.
+ */
+static void
+redisPollPrefetch(RedisFdwExecutionState *festate)
+{
+	struct pollfd pfd;
+
+	if (!festate->prefetch_sent || festate->prefetch_reply != NULL)
+		return;
+
+	pfd.fd = festate->context->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, 0) > 0 &&
+		redisBufferRead(festate->context) != REDIS_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+				 errmsg("failed to read the next page: %s",
+						festate->context->errstr)
+				 ));
+
+	/* it's only ours if nothing else is due first */
+	if (festate->prefetch_ahead == 0 &&
+		redisGetReplyFromReader(festate->context,
+								(void **) &festate->prefetch_reply) != REDIS_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+				 errmsg("failed to read the next page: %s",
+						festate->context->errstr)
+				 ));
+
+	/* it came without waiting for it */
+	if (festate->prefetch_reply != NULL)
+	{
+		festate->ncommands++;
+		if (festate->instrument)
+			festate->nbytes += redisReplyBytes(festate->prefetch_reply);
+	}
+}
+
+/*
+ * redisSetKeyList
+ *		Make the keys from a pushed down qual the only page to scan.
+ *
+ * Keys without the table's prefix can't be in the table, so we drop them
+ * here, along with any duplicates; keyset membership is checked on the
+ * server as the values are fetched.
+ */
+static void
+redisSetKeyList(RedisFdwExecutionState *festate, List *values)
+{
+	ListCell   *lc;
+	long long	nkeys = 0;
+	long long	i;
+	int			prefixlen = 0;
+
+	if (festate->keyprefix)
+		prefixlen = strlen(festate->keyprefix);
+
+	festate->keys = palloc(sizeof(char *) * (list_length(values) + 1));
+	festate->keylens = palloc(sizeof(size_t) * (list_length(values) + 1));
+
+	foreach(lc, values)
+	{
+		char	   *key = (char *) lfirst(lc);
+
+		if (prefixlen > 0 && strncmp(key, festate->keyprefix, prefixlen) != 0)
+			continue;
+
+		festate->keys[nkeys++] = key;
+	}
+
+	if (nkeys > 1)
+	{
+		long long	nunique = 1;
+
+		qsort(festate->keys, nkeys, sizeof(char *), redisCompareKeys);
+		for (i = 1; i < nkeys; i++)
+		{
+			if (strcmp(festate->keys[i], festate->keys[nunique - 1]) != 0)
+				festate->keys[nunique++] = festate->keys[i];
+		}
+		nkeys = nunique;
+	}
+
+	for (i = 0; i < nkeys; i++)
+		festate->keylens[i] = strlen(festate->keys[i]);
+
+	festate->nkeys = nkeys;
+	festate->row = 0;
+	festate->check_keyset = (festate->keyset != NULL);
+
+	if (festate->cluster)
+		redisClusterRoutePage(festate);
+
+	/* keys from a qual may not exist at all */
+	festate->check_exists = true;
+}
+
+static int
+redisCompareKeys(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * redisSetParamKey
+ *		Evaluate the key expression for the current parameter values, and
+ *		make that key the only one to fetch.
+ */
+static void
+redisSetParamKey(ForeignScanState *node, RedisFdwExecutionState *festate)
+{
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	ExprState  *expr_state = (ExprState *) linitial(festate->param_exprs);
+	MemoryContext oldcontext;
+	List	   *values = NIL;
+	Datum		value;
+	bool		isnull;
+
+	/* the last key list lives in param_cxt, so this frees it */
+	MemoryContextReset(festate->param_cxt);
+	festate->keys = NULL;
+	festate->keylens = NULL;
+	festate->keynodes = NULL;
+
+	oldcontext = MemoryContextSwitchTo(festate->param_cxt);
+
+	value = ExecEvalExpr(expr_state, econtext, &isnull, NULL);
+
+	/* a NULL key can't match anything, so we just return no rows */
+	if (!isnull)
+		values = list_make1(TextDatumGetCString(value));
+
+	redisSetKeyList(festate, values);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	festate->param_pending = false;
+}
+
+/*
+ * redisIterateForeignScan
+ *		Read next record from the data file and store it into the
+ *		ScanTupleSlot as a virtual tuple
+ *
+ * We have now spearated this into two streams of logic - one
+ * for singleton key tables and one for multi-key tables.
+ */
+
+static TupleTableSlot *
+redisIterateForeignScan(ForeignScanState *node)
+{
+	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+
+	/* once we've given the LIMIT all it wants, don't fetch any more */
+	if (festate->limit > 0 && festate->nreturned >= festate->limit)
+		return ExecClearTuple(slot);
+
+	/* past the end of a table we only had to count */
+	if (festate->count_rows >= 0 && festate->nreturned >= festate->count_rows)
+		return ExecClearTuple(slot);
+
+	/*
+	 * The rows the OFFSET throws away can be empty, and so can all of them
+	 * if nothing is wanted from them.
+	 */
+	if (festate->nreturned < festate->offset || festate->count_rows >= 0)
+	{
+		int			i;
+
+		ExecClearTuple(slot);
+		for (i = 0; i < slot->tts_tupleDescriptor->natts; i++)
+			slot->tts_isnull[i] = true;
+		if (festate->count_rows >= 0 &&
+			festate->count_key_attnum != InvalidAttrNumber)
+		{
+			slot->tts_values[festate->count_key_attnum - 1] = festate->count_key;
+			slot->tts_isnull[festate->count_key_attnum - 1] = false;
+		}
+		ExecStoreVirtualTuple(slot);
+		festate->nreturned++;
+		return slot;
+	}
+
+	if (festate->singleton_key)
+		slot = redisIterateForeignScanSingleton(node);
+	else
+		slot = redisIterateForeignScanMulti(node);
+
+	if (!TupIsNull(slot))
+		festate->nreturned++;
+
+	return slot;
+}
+
+static inline TupleTableSlot *
+redisIterateForeignScanMulti(ForeignScanState *node)
+{
+	redisReply *reply;
+	char	   *key;
+	MemoryContext oldcontext;
+
+	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisIterateForeignScanMulti");
+#endif
+
+	/* Cleanup */
+	ExecClearTuple(slot);
+
+	if (festate->param_pending)
+		redisSetParamKey(node, festate);
+
+	/*
+	 * Get the next record, if there is one, and put its values straight
+	 * into the slot. Whatever the conversions allocate only has to last
+	 * until the next call.
+	 */
+	if (redisFetchNextValue(festate, &key, &reply))
+	{
+		MemoryContextReset(festate->tuple_cxt);
+		oldcontext = MemoryContextSwitchTo(festate->tuple_cxt);
+		redisFormMultiRow(festate, key, reply,
+						  slot->tts_values, slot->tts_isnull);
+		MemoryContextSwitchTo(oldcontext);
+		ExecStoreVirtualTuple(slot);
+	}
+
+	return slot;
+}
+
+/*
+ * redisFetchNextValue
+ *		Get the next key of a multi-key scan that has a value, and the reply
+ *		holding the value. Returns false at the end of the scan.
+ *
+ * The reply belongs to the batch or the page, and lasts until the next
+ * batch is sent.
+ */
+static bool
+redisFetchNextValue(RedisFdwExecutionState *festate, char **keyp,
+					redisReply **replyp)
+{
+	redisReply *reply;
+	char	   *key;
+
+	/*
+	 * Get the next key from the page, and its value from the current batch.
+	 * If the value is nil, or the key turns out not to be in the keyset, we
+	 * go ahead and get the next row.
+	 */
+	while (true)
+	{
+		bool		member = true;
+		bool		exists = true;
+
+		/*
+		 * If we're out of rows on the cursor page, fetch the next set.
+		 * Keep going until we get a result back that actually has some
+		 * rows.
+		 */
+		if (festate->row >= festate->nkeys)
+		{
+			if (festate->cursor_id == NULL)
+				return false;
+
+			redisFetchNextPage(festate);
+			continue;
+		}
+
+		if (festate->row >= festate->batch_end && !festate->scan_script)
+		{
+			redisPollPrefetch(festate);
+			redisSendValueBatch(festate);
+		}
+
+		key = festate->keys[festate->row];
+
+		if (festate->scan_script)
+		{
+			/* the script has checked the type, and sent the value along */
+			reply = festate->fetch_values ?
+				festate->page_values[festate->row] : NULL;
+		}
+		else if (!festate->fetch_values)
+		{
+			/* there's no value, just the answer to TYPE if we asked it */
+			reply = NULL;
+
+			if (festate->check_exists)
+			{
+				redisReply *treply = redisGetKeyReply(festate, festate->row);
+
+				exists = redisKeyHasType(treply, festate->table_type);
+			}
+		}
+		else if (festate->table_type == PG_REDIS_SCALAR_TABLE &&
+				 !festate->cluster)
+		{
+			/* the values for the whole batch come in one MGET reply */
+			if (festate->batch_reply == NULL)
+			{
+				festate->batch_reply = redisGetPendingReply(festate);
+
+				if (festate->batch_reply->type != REDIS_REPLY_ARRAY ||
+					festate->batch_reply->elements !=
+					festate->batch_end - festate->batch_start)
+					ereport(ERROR,
+							(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+							 errmsg("unexpected reply type %d from MGET",
+									festate->batch_reply->type)
+								));
+			}
+			reply = festate->batch_reply->element[festate->row -
+												  festate->batch_start];
+		}
+		else if (festate->filter_fields.nfields > 0 &&
+				 !festate->batch_member[festate->row - festate->batch_start])
+		{
+			/* it failed the quals, so we didn't ask for the rest of it */
+			reply = NULL;
+		}
+		else
+		{
+			reply = redisGetKeyReply(festate, festate->row);
+		}
+
+		if (festate->batch_checked)
+			member = festate->batch_member[festate->row - festate->batch_start];
+
+		festate->row++;
+
+		/*
+		 * An empty collection means the key doesn't exist, which we can
+		 * only get for keys from a qual.
+		 */
+		if (!member || !exists ||
+			(reply != NULL &&
+			 (reply->type == REDIS_REPLY_NIL ||
+			  reply->type == REDIS_REPLY_STATUS ||
+			  reply->type == REDIS_REPLY_ERROR ||
+			  (reply->type == REDIS_REPLY_ARRAY && reply->elements == 0))))
+		{
+			festate->nskipped++;
+			continue;
+		}
+
+		/* only the script's values come from the page */
+		festate->text_replies = !festate->scan_script;
+
+		*keyp = key;
+		*replyp = reply;
+		return true;
+	}
+}
+
+/*
+ * redisKeyHasType
+ *		Does the reply to TYPE say the key holds the kind of value the table
+ *		is made of? A key that doesn't exist has the type "none".
+ */
+static bool
+redisKeyHasType(redisReply *reply, redis_table_type type)
+{
+	if (reply->type != REDIS_REPLY_STATUS)
+		return false;
+
+	return strcmp(reply->str, redisTableTypeName(type)) == 0;
+}
+
+/*
+ * redisTableTypeName
+ *		The name TYPE gives the kind of value a table is made of.
+ */
+static const char *
+redisTableTypeName(redis_table_type type)
+{
+	switch (type)
+	{
+		case PG_REDIS_HASH_TABLE:
+			return "hash";
+		case PG_REDIS_LIST_TABLE:
+			return "list";
+		case PG_REDIS_SET_TABLE:
+			return "set";
+		case PG_REDIS_ZSET_TABLE:
+			return "zset";
+		case PG_REDIS_SCALAR_TABLE:
+		default:
+			return "string";
+	}
+}
+
+/*
+ * redisDedupePage
+ *		Drop the keys of the current page that the scan has seen before,
+ *		before we ask for their values. with_nodes says whether keynodes
+ *		goes with the keys yet.
+ */
+static void
+redisDedupePage(RedisFdwExecutionState *festate, bool with_nodes)
+{
+	long long	nkeys = 0;
+	long long	i;
+
+	for (i = 0; i < festate->nkeys; i++)
+	{
+		if (redisSeenKey(festate->seen_keys, festate->keys[i],
+						 festate->keylens[i]))
+		{
+			festate->nduplicates++;
+			continue;
+		}
+
+		festate->keys[nkeys] = festate->keys[i];
+		festate->keylens[nkeys] = festate->keylens[i];
+		if (festate->page_values)
+			festate->page_values[nkeys] = festate->page_values[i];
+		if (with_nodes)
+			festate->keynodes[nkeys] = festate->keynodes[i];
+		nkeys++;
+	}
+
+	festate->nkeys = nkeys;
+}
+
+/*
+ * redisCreateSeenKeys
+ *		Make an empty set of seen keys in the current memory context.
+ */
+static RedisSeenKeys *
+redisCreateSeenKeys(void)
+{
+	RedisSeenKeys *seen = (RedisSeenKeys *) palloc0(sizeof(RedisSeenKeys));
+
+	seen->cxt = CurrentMemoryContext;
+	redisResetSeenKeys(seen);
+
+	return seen;
+}
+
+/*
+ * redisResetSeenKeys
+ *		Forget all the keys, and go back to a small hash set.
+ */
+static void
+redisResetSeenKeys(RedisSeenKeys *seen)
+{
+	if (seen->set)
+		pfree(seen->set);
+	if (seen->bloom)
+		pfree(seen->bloom);
+
+	seen->size = SEEN_KEYS_INITIAL_SIZE;
+	seen->set = (uint64 *) MemoryContextAllocZero(seen->cxt,
+												  sizeof(uint64) * seen->size);
+	seen->nkeys = 0;
+	seen->bloom = NULL;
+	seen->nbits = 0;
+	seen->nhashes = 0;
+	seen->max_keys = 0;
+	seen->full = false;
+}
+
+/*
+ * redisSeenKey
+ *		Has the key been seen before? If not, it has now.
+ *
+ * The set is doubled when it's three quarters full, unless that would take
+ * it over work_mem, when it becomes a Bloom filter instead. When the filter
+ * has as many keys as it can hold without too many false positives, we
+ * warn, and take every key after that to be new.
+ */
+static bool
+redisSeenKey(RedisSeenKeys *seen, const char *key, size_t keylen)
+{
+	uint64		fp;
+	uint64		i;
+
+	if (seen->full)
+		return false;
+
+	if (seen->bloom && seen->nkeys >= seen->max_keys)
+	{
+		ereport(WARNING,
+				(errmsg("scan_dedupe has seen too many keys to track in work_mem"),
+				 errdetail("Keys returned more than once after the first %lu will not be dropped.",
+						   (unsigned long) seen->nkeys),
+				 errhint("Increase work_mem.")));
+		pfree(seen->bloom);
+		seen->bloom = NULL;
+		seen->full = true;
+		return false;
+	}
+
+	fp = redisKeyFingerprint(key, keylen);
+
+	if (seen->bloom)
+	{
+		/* double hashing, with the two halves of the fingerprint */
+		uint64		h1 = fp & 0xFFFFFFFF;
+		uint64		h2 = (fp >> 32) | 1;
+		bool		found = true;
+		int			k;
+
+		for (k = 0; k < seen->nhashes; k++)
+		{
+			uint64		bit = (h1 + k * h2) & (seen->nbits - 1);
+
+			if (!(seen->bloom[bit / 8] & (1 << (bit % 8))))
+			{
+				found = false;
+				seen->bloom[bit / 8] |= (1 << (bit % 8));
+			}
+		}
+
+		if (!found)
+			seen->nkeys++;
+		return found;
+	}
+
+	for (i = fp & (seen->size - 1);; i = (i + 1) & (seen->size - 1))
+	{
+		if (seen->set[i] == fp)
+			return true;
+		if (seen->set[i] == 0)
+			break;
+	}
+
+	seen->set[i] = fp;
+	seen->nkeys++;
+
+	if (seen->nkeys * 4 > seen->size * 3)
+	{
+		uint64		size = seen->size * 2;
+		uint64	   *set;
+		uint64		j;
+
+		if (size * sizeof(uint64) > (uint64) work_mem * 1024L)
+		{
+			redisSeenKeysToBloom(seen);
+			return false;
+		}
+
+		set = (uint64 *) MemoryContextAllocHuge(seen->cxt,
+												sizeof(uint64) * size);
+		memset(set, 0, sizeof(uint64) * size);
+
+		for (j = 0; j < seen->size; j++)
+		{
+			if (seen->set[j] == 0)
+				continue;
+			for (i = seen->set[j] & (size - 1); set[i] != 0;
+				 i = (i + 1) & (size - 1))
+				;
+			set[i] = seen->set[j];
+		}
+
+		pfree(seen->set);
+		seen->set = set;
+		seen->size = size;
+	}
+
+	return false;
+}
+
+/*
+ * redisKeyFingerprint
+ *		A 64 bit hash of the key, which is never 0: FNV-1a, with the
+ *		finalizer of MurmurHash3 to spread it into the low bits we use.
+ */
+static uint64
+redisKeyFingerprint(const char *key, size_t keylen)
+{
+	uint64		h = UINT64CONST(0xcbf29ce484222325);
+	size_t		i;
+
+	for (i = 0; i < keylen; i++)
+	{
+		h ^= (unsigned char) key[i];
+		h *= UINT64CONST(0x100000001b3);
+	}
+
+	h ^= h >> 33;
+	h *= UINT64CONST(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+
+	return h ? h : 1;
+}
+
+/*
+ * redisSeenKeysToBloom
+ *		Replace the hash set with a Bloom filter of work_mem, holding the
+ *		same keys.
+ *
+ * A filter of m bits that sets k bits for each of n keys takes a new key
+ * for an old one with a chance of about (1 - e^(-kn/m))^k. The k that lets
+ * it hold the most keys before that reaches SEEN_KEYS_MAX_FALSE_POSITIVE,
+ * p, is -log2(p), and that many keys is -m/k * ln(1 - p^(1/k)), which is
+ * several times as many as the hash set held in the same memory.
+ */
+static void
+redisSeenKeysToBloom(RedisSeenKeys *seen)
+{
+	uint64		nbits = 8;
+	uint64		nkeys = seen->nkeys;
+	uint64		i;
+	double		p = SEEN_KEYS_MAX_FALSE_POSITIVE;
+
+	while (nbits * 2 <= (uint64) work_mem * 1024L * 8)
+		nbits *= 2;
+
+	seen->nbits = nbits;
+	seen->nhashes = (int) ceil(-log(p) / log(2.0));
+	seen->max_keys = (uint64) (-((double) nbits / seen->nhashes) *
+							   log(1.0 - pow(p, 1.0 / seen->nhashes)));
+	seen->bloom = (uint8 *) MemoryContextAllocHuge(seen->cxt, nbits / 8);
+	memset(seen->bloom, 0, nbits / 8);
+
+	/* the fingerprints are all we need to set their bits */
+	for (i = 0; i < seen->size; i++)
+	{
+		uint64		h1 = seen->set[i] & 0xFFFFFFFF;
+		uint64		h2 = (seen->set[i] >> 32) | 1;
+		int			k;
+
+		if (seen->set[i] == 0)
+			continue;
+
+		for (k = 0; k < seen->nhashes; k++)
+		{
+			uint64		bit = (h1 + k * h2) & (nbits - 1);
+
+			seen->bloom[bit / 8] |= (1 << (bit % 8));
+		}
+	}
+
+	pfree(seen->set);
+	seen->set = NULL;
+	seen->size = 0;
+	seen->nkeys = nkeys;
+}
+
+/*
+ * redisFormMultiRow
+ *		Fill in the values of the row for a key of a multi-key table and its
+ *		value, which is NULL if we didn't fetch it.
+ */
+static void
+redisFormMultiRow(RedisFdwExecutionState *festate, char *key,
+				  redisReply *reply, Datum *values, bool *nulls)
+{
+	int			natts = festate->attinmeta->tupdesc->natts;
+	int			i;
+
+	for (i = 0; i < natts; i++)
+		nulls[i] = true;
+
+	if (natts > 0)
+	{
+		values[0] = redisStringDatum(festate, 0, key, strlen(key));
+		nulls[0] = false;
+	}
+
+	if (reply == NULL)
+		;
+	else if (festate->fetch_fields.nfields > 0)
+		redisFormHashFields(festate, &festate->fetch_fields, reply,
+							values, nulls);
+	else
+	{
+		if (natts > 1 &&
+			(festate->field_names == NULL || festate->field_names[1] == NULL))
+			values[1] = redisReplyDatum(festate, 1, reply, &nulls[1]);
+		if (festate->field_names != NULL)
+			redisPickHashFields(festate, reply, values, nulls);
+	}
+
+	/*
+	 * The fields the quals were checked on were fetched first. The row has
+	 * already been counted, so it's the one before festate->row.
+	 */
+	if (festate->filter_fields.nfields > 0)
+		redisFormHashFields(festate, &festate->filter_fields,
+							festate->batch_filter[festate->row - 1 -
+												  festate->batch_start],
+							values, nulls);
+}
+
+/*
+ * redisGetHashFields
+ *		Find the columns of a hash table that hold single fields of the
+ *		hash, and return the name of the field for each column, with NULL
+ *		for the key and the value. Returns NULL if there are none.
+ *
+ * Any column but the key can name its field with the field option, and
+ * one after the key and value that doesn't is the field of the same name.
+ */
+static char **
+redisGetHashFields(Relation rel)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	char	  **field_names;
+	bool		found = false;
+	int			i;
+
+	field_names = (char **) palloc0(sizeof(char *) * tupdesc->natts);
+
+	for (i = 1; i < tupdesc->natts; i++)
+	{
+		ListCell   *lc;
+
+		if (tupdesc->attrs[i]->attisdropped)
+			continue;
+
+		if (i > 1)
+			field_names[i] = NameStr(tupdesc->attrs[i]->attname);
+
+		foreach(lc, GetForeignColumnOptions(RelationGetRelid(rel), i + 1))
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "field") == 0)
+				field_names[i] = defGetString(def);
+		}
+
+		if (field_names[i] != NULL)
+			found = true;
+	}
+
+	if (!found)
+	{
+		pfree(field_names);
+		return NULL;
+	}
+
+	return field_names;
+}
+
+/*
+ * redisSetupHashFields
+ *		Work out which fields of a hash table to fetch with HMGET, and which
+ *		of them to fetch first so that the quals on them can be checked
+ *		before we fetch the rest.
+ *
+ * If the value column is wanted we need the whole hash anyway, so it's
+ * fetched with HGETALL and the fields are picked out of that.
+ */
+static void
+redisSetupHashFields(ForeignScanState *node, RedisFdwExecutionState *festate,
+					 List *retrieved_attrs)
+{
+	char	  **field_names;
+	Bitmapset  *fetch = NULL;
+	Bitmapset  *filter = NULL;
+	List	   *filter_quals = NIL;
+	Index		scanrelid = ((Scan *) node->ss.ps.plan)->scanrelid;
+	ListCell   *lc;
+
+	field_names = redisGetHashFields(node->ss.ss_currentRelation);
+	festate->field_names = field_names;
+	if (field_names == NULL)
+		return;
+
+	foreach(lc, retrieved_attrs)
+	{
+		AttrNumber	attnum = lfirst_int(lc);
+
+		if (attnum == 1)
+			continue;
+		if (field_names[attnum - 1] == NULL)
+			return;
+		fetch = bms_add_member(fetch, attnum);
+	}
+
+	if (bms_is_empty(fetch))
+		return;
+
+	/* quals on nothing but the key and the fields can be checked early */
+	foreach(lc, node->ss.ps.qual)
+	{
+		ExprState  *state = (ExprState *) lfirst(lc);
+		Bitmapset  *attrs_used = NULL;
+		Bitmapset  *qual_fields = NULL;
+		ListCell   *alc;
+
+		if (contain_volatile_functions((Node *) state->expr))
+			continue;
+
+		pull_varattnos((Node *) state->expr, scanrelid, &attrs_used);
+
+		foreach(alc, redisRetrievedAttrs(attrs_used,
+							  festate->attinmeta->tupdesc->natts))
+		{
+			AttrNumber	attnum = lfirst_int(alc);
+
+			if (attnum == 1)
+				continue;
+			if (field_names[attnum - 1] == NULL)
+			{
+				qual_fields = NULL;
+				break;
+			}
+			qual_fields = bms_add_member(qual_fields, attnum);
+		}
+
+		if (bms_is_empty(qual_fields))
+			continue;
+
+		filter = bms_add_members(filter, qual_fields);
+		filter_quals = lappend(filter_quals, state);
+	}
+
+	/* it's only worth two round trips if there's something left to skip */
+	if (!bms_is_empty(filter) && !bms_is_subset(fetch, filter))
+	{
+		fetch = bms_del_members(fetch, filter);
+		redisSetHashFields(&festate->filter_fields, field_names, filter);
+		festate->filter_quals = filter_quals;
+		/*
+		 * The quals are checked while we're fetching a batch, in the
+		 * scan's per-tuple memory, so they need an econtext of their own
+		 * to reset.
+		 */
+		festate->filter_econtext = CreateExprContext(node->ss.ps.state);
+		festate->filter_slot = node->ss.ss_ScanTupleSlot;
+		festate->batch_filter = (redisReply **)
+			palloc0(sizeof(redisReply *) * festate->fetch_batch_size);
+	}
+
+	redisSetHashFields(&festate->fetch_fields, field_names, fetch);
+}
+
+/*
+ * redisSetHashFields
+ *		Set up the HMGET for the fields of the columns in attnums.
+ */
+static void
+redisSetHashFields(RedisHashFields *fields, char **field_names,
+				   Bitmapset *attnums)
+{
+	int			nfields = bms_num_members(attnums);
+	int			attnum = -1;
+	int			i = 0;
+
+	fields->nfields = nfields;
+	fields->attnums = (AttrNumber *) palloc(sizeof(AttrNumber) * nfields);
+	fields->argv = (const char **) palloc(sizeof(char *) * (nfields + 2));
+	fields->argvlen = (size_t *) palloc(sizeof(size_t) * (nfields + 2));
+	fields->argv[0] = "HMGET";
+	fields->argvlen[0] = 5;
+
+	while ((attnum = bms_next_member(attnums, attnum)) >= 0)
+	{
+		fields->attnums[i] = attnum;
+		fields->argv[i + 2] = field_names[attnum - 1];
+		fields->argvlen[i + 2] = strlen(field_names[attnum - 1]);
+		i++;
+	}
+}
+
+/*
+ * redisAppendHashFields
+ *		Queue the HMGET of the fields for one key.
+ */
+static int
+redisAppendHashFields(redisContext *context, RedisHashFields *fields,
+					  const char *key, size_t keylen)
+{
+	fields->argv[1] = key;
+	fields->argvlen[1] = keylen;
+
+	return redisAppendCommandArgv(context, fields->nfields + 2,
+								  fields->argv, fields->argvlen);
+}
+
+/*
+ * redisFormHashFields
+ *		Fill in the columns of the fields from the reply to their HMGET. A
+ *		field the hash doesn't have is null.
+ */
+static void
+redisFormHashFields(RedisFdwExecutionState *festate, RedisHashFields *fields,
+					redisReply *reply, Datum *values, bool *nulls)
+{
+	int			i;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+		reply->elements != fields->nfields)
+		return;
+
+	for (i = 0; i < fields->nfields; i++)
+	{
+		int			attnum = fields->attnums[i] - 1;
+
+		values[attnum] = redisReplyDatum(festate, attnum, reply->element[i],
+										 &nulls[attnum]);
+	}
+}
+
+/*
+ * redisPickHashFields
+ *		Fill in the columns of the fields from the reply to HGETALL.
+ */
+static void
+redisPickHashFields(RedisFdwExecutionState *festate, redisReply *reply,
+					Datum *values, bool *nulls)
+{
+	int			natts = festate->attinmeta->tupdesc->natts;
+	size_t		i;
+	int			attnum;
+
+	if (reply->type != REDIS_REPLY_ARRAY)
+		return;
+
+	for (i = 0; i + 1 < reply->elements; i += 2)
+	{
+		redisReply *field = reply->element[i];
+
+		for (attnum = 1; attnum < natts; attnum++)
+		{
+			if (festate->field_names[attnum] != NULL &&
+				field->type == REDIS_REPLY_STRING &&
+				strlen(festate->field_names[attnum]) == field->len &&
+				memcmp(festate->field_names[attnum], field->str,
+					   field->len) == 0)
+				values[attnum] = redisReplyDatum(festate, attnum,
+												 reply->element[i + 1],
+												 &nulls[attnum]);
+		}
+	}
+}
+
+/*
+ * redisGetAttKinds
+ *		Work out how to make the Datum for each column of the table.
+ */
+static redis_att_kind *
+redisGetAttKinds(TupleDesc tupdesc)
+{
+	redis_att_kind *kinds;
+	int			i;
+
+	kinds = (redis_att_kind *) palloc(sizeof(redis_att_kind) * tupdesc->natts);
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute attr = tupdesc->attrs[i];
+
+		switch (attr->atttypid)
+		{
+			case TEXTOID:
+				kinds[i] = PG_REDIS_ATT_TEXT;
+				break;
+			case TEXTARRAYOID:
+				kinds[i] = PG_REDIS_ATT_TEXTARRAY;
+				break;
+			case VARCHAROID:
+				/* without a length limit, varchar is just text */
+				kinds[i] = attr->atttypmod < 0 ?
+					PG_REDIS_ATT_TEXT : PG_REDIS_ATT_INPUT;
+				break;
+			case INT8OID:
+				kinds[i] = PG_REDIS_ATT_INT8;
+				break;
+			case FLOAT8OID:
+				kinds[i] = PG_REDIS_ATT_FLOAT8;
+				break;
+			default:
+				kinds[i] = PG_REDIS_ATT_INPUT;
+				break;
+		}
+	}
+
+	return kinds;
+}
+
+/*
+ * redisStringDatum
+ *		Make the Datum for a column from a string Redis sent us.
+ *
+ * Like textin, we stop at a zero byte, since text can't hold one.
+ */
+static Datum
+redisStringDatum(RedisFdwExecutionState *festate, int attnum,
+				 const char *str, size_t len)
+{
+	AttInMetadata *attinmeta = festate->attinmeta;
+
+	if (festate->attkinds[attnum] == PG_REDIS_ATT_TEXT)
+		return PointerGetDatum(cstring_to_text_with_len(str,
+														strnlen(str, len)));
+
+	return InputFunctionCall(&attinmeta->attinfuncs[attnum], (char *) str,
+							 attinmeta->attioparams[attnum],
+							 attinmeta->atttypmods[attnum]);
+}
+
+/*
+ * redisReplyDatum
+ *		Make the Datum for a column from a reply, setting *isnull if there's
+ *		nothing in it we can use.
+ */
+static Datum
+redisReplyDatum(RedisFdwExecutionState *festate, int attnum,
+				redisReply *reply, bool *isnull)
+{
+	char		buf[64];
+	char	   *data;
+
+	*isnull = false;
+
+	switch (reply->type)
+	{
+		case REDIS_REPLY_INTEGER:
+			if (festate->attkinds[attnum] == PG_REDIS_ATT_INT8)
+				return Int64GetDatum((int64) reply->integer);
+			if (festate->attkinds[attnum] == PG_REDIS_ATT_FLOAT8)
+				return Float8GetDatum((float8) reply->integer);
+			snprintf(buf, sizeof(buf), "%lld", reply->integer);
+			return redisStringDatum(festate, attnum, buf, strlen(buf));
+
+		case REDIS_REPLY_STRING:
+			/* one of ours is already a text datum, unless it has a NUL */
+			if (festate->text_replies &&
+				festate->attkinds[attnum] == PG_REDIS_ATT_TEXT &&
+				memchr(reply->str, '\0', reply->len) == NULL)
+				return PointerGetDatum(reply->str - VARHDRSZ);
+			return redisStringDatum(festate, attnum, reply->str, reply->len);
+
+		case REDIS_REPLY_ARRAY:
+			if (festate->attkinds[attnum] == PG_REDIS_ATT_TEXTARRAY)
+				return redisArrayDatum(festate, reply);
+			data = process_redis_array(reply, festate->table_type);
+			return redisStringDatum(festate, attnum, data, strlen(data));
+	}
+
+	*isnull = true;
+	return (Datum) 0;
+}
+
+/*
+ * redisArrayDatum
+ *		Make a text array straight from the elements of an array reply,
+ *		rather than writing it out as text for array_in to parse again. A
+ *		nil element is a null.
+ */
+static Datum
+redisArrayDatum(RedisFdwExecutionState *festate, redisReply *reply)
+{
+	Datum	   *elems;
+	bool	   *nulls;
+	int			dims[1];
+	int			lbs[1];
+	size_t		i;
+
+	if (reply->elements == 0)
+		return PointerGetDatum(construct_empty_array(TEXTOID));
+
+	elems = (Datum *) palloc(sizeof(Datum) * reply->elements);
+	nulls = (bool *) palloc(sizeof(bool) * reply->elements);
+
+	for (i = 0; i < reply->elements; i++)
+	{
+		redisReply *ir = reply->element[i];
+		char		buf[64];
+
+		nulls[i] = false;
+
+		switch (ir->type)
+		{
+			case REDIS_REPLY_STATUS:
+			case REDIS_REPLY_STRING:
+				pg_verifymbstr(ir->str, ir->len, false);
+				if (festate->text_replies &&
+					memchr(ir->str, '\0', ir->len) == NULL)
+					elems[i] = PointerGetDatum(ir->str - VARHDRSZ);
+				else
+					elems[i] = PointerGetDatum(cstring_to_text_with_len(ir->str,
+														 strnlen(ir->str, ir->len)));
+				break;
+			case REDIS_REPLY_INTEGER:
+				snprintf(buf, sizeof(buf), "%lld", ir->integer);
+				elems[i] = PointerGetDatum(cstring_to_text(buf));
+				break;
+			case REDIS_REPLY_ARRAY:
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("nested array returns not yet supported")));
+				break;
+			default:
+				elems[i] = (Datum) 0;
+				nulls[i] = true;
+				break;
+		}
+	}
+
+	dims[0] = reply->elements;
+	lbs[0] = 1;
+
+	return PointerGetDatum(construct_md_array(elems, nulls, 1, dims, lbs,
+											  TEXTOID, -1, false, 'i'));
+}
+
+/*
+ * redisSendValueBatch
+ *		Pipeline the value commands for the next batch of keys on the
+ *		current cursor page.
+ *
+ * The commands are all written to the server together, and the replies are
+ * read back one at a time by redisGetPendingReply as the tuples are
+ * returned, so we only wait for one round trip per batch rather than one
+ * per key. Scalar values are fetched with a single MGET for the batch.
+ */
+static void
+redisSendValueBatch(RedisFdwExecutionState *festate)
+{
+	redisContext *context = festate->context;
+	char	  **keys = festate->keys;
+	size_t	   *keylens = festate->keylens;
+	long long	first = festate->row;
+	long long	last;
+	long long	i;
+	int			res = REDIS_OK;
+
+	last = first + festate->fetch_batch_size;
+	if (last > festate->nkeys)
+		last = festate->nkeys;
+
+	/* don't fetch more values than the LIMIT can use */
+	if (festate->limit > 0 && last - first > festate->limit - festate->nreturned)
+		last = first + Max(festate->limit - festate->nreturned, 1);
+
+	/*
+	 * In a cluster, the page is in order of the node holding each key, and
+	 * a batch only goes to one node.
+	 */
+	if (festate->cluster)
+	{
+		for (i = first + 1; i < last; i++)
+		{
+			if (festate->keynodes[i] != festate->keynodes[first])
+				break;
+		}
+		last = i;
+		context = redisClusterConnection(festate, festate->keynodes[first]);
+	}
+	festate->batch_context = context;
+
+	/* anything left over from the previous batch has been used up */
+	festate->batch_reply = NULL;
+	redisFreeBatch(festate);
+
+	/*
+	 * Keys from a qual must be checked against the keyset first. In a
+	 * cluster the keyset is on its own node, so we wait for the answers
+	 * there before asking for the values.
+	 */
+	if (festate->check_keyset)
+	{
+		redisContext *mcontext = festate->cluster ? festate->context : context;
+
+		for (i = first; i < last && res == REDIS_OK; i++)
+		{
+			res = redisAppendCommand(mcontext, "SISMEMBER %s %b",
+									 festate->keyset, keys[i], keylens[i]);
+			if (!festate->cluster)
+				festate->pending++;
+		}
+
+		if (festate->cluster && res == REDIS_OK)
+			redisReadMembership(festate, mcontext, first, last);
+	}
+
+	/*
+	 * HMGET gives us nils for a hash that isn't there, so if that matters
+	 * we have to ask whether it exists as well.
+	 */
+	if (festate->fetch_values && festate->fetch_fields.nfields > 0 &&
+		festate->check_exists)
+	{
+		for (i = first; i < last && res == REDIS_OK; i++)
+		{
+			res = redisAppendCommand(context, "EXISTS %b",
+									 keys[i], keylens[i]);
+			festate->pending++;
+		}
+	}
+
+	if (!festate->fetch_values)
+	{
+		/* we only want the keys, but may have to check they're still there */
+		if (festate->check_exists)
+		{
+			for (i = first; i < last && res == REDIS_OK; i++)
+			{
+				res = redisAppendKeyCommand(festate, context,
+											keys[i], keylens[i]);
+				festate->pending++;
+			}
+		}
+	}
+	else if (festate->table_type == PG_REDIS_SCALAR_TABLE &&
+			 !festate->cluster)
+	{
+		int			argc = last - first + 1;
+		const char **argv = palloc(sizeof(char *) * argc);
+		size_t	   *argvlen = palloc(sizeof(size_t) * argc);
+
+		argv[0] = "MGET";
+		argvlen[0] = 4;
+		for (i = first; i < last; i++)
+		{
+			argv[i - first + 1] = keys[i];
+			argvlen[i - first + 1] = keylens[i];
+		}
+
+		if (res == REDIS_OK)
+			res = redisAppendCommandArgv(context, argc, argv, argvlen);
+		festate->pending++;
+
+		pfree(argv);
+		pfree(argvlen);
+	}
+	else
+	{
+		/*
+		 * MGET can't span cluster slots, so there it's a GET for each key.
+		 * If we can check some quals first, we only ask for the fields they
+		 * need here, and for the rest of the row once it's passed.
+		 */
+		festate->filtering = (festate->filter_fields.nfields > 0);
+		for (i = first; i < last && res == REDIS_OK; i++)
+		{
+			res = redisAppendKeyCommand(festate, context, keys[i], keylens[i]);
+			festate->pending++;
+		}
+		festate->filtering = false;
+	}
+
+	if (res != REDIS_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_OUT_OF_MEMORY),
+				 errmsg("failed to queue value commands: %s",
+						context->errstr)
+				 ));
+
+	festate->batch_start = first;
+	festate->batch_end = last;
+
+	/*
+	 * The membership replies come back ahead of the values, so read them
+	 * now. This flushes the whole batch to the server in one go.
+	 */
+	festate->batch_checked = festate->check_keyset;
+	if (festate->check_keyset && !festate->cluster)
+		redisReadMembership(festate, NULL, first, last);
+
+	if (festate->fetch_values && festate->fetch_fields.nfields > 0)
+	{
+		if (festate->check_exists)
+			redisReadExists(festate, first, last);
+		if (festate->filter_fields.nfields > 0)
+			redisFilterBatch(festate, first, last);
+	}
+}
+
+/*
+ * redisAppendKeyCommand
+ *		Queue the command that gets what we want to know about one key: its
+ *		value, or just its type if we don't need the value.
+ */
+static int
+redisAppendKeyCommand(RedisFdwExecutionState *festate, redisContext *context,
+					  const char *key, size_t keylen)
+{
+	if (!festate->fetch_values)
+		return redisAppendCommand(context, "TYPE %b", key, keylen);
+
+	switch (festate->table_type)
+	{
+		case PG_REDIS_SCALAR_TABLE:
+			return redisAppendCommand(context, "GET %b", key, keylen);
+		case PG_REDIS_HASH_TABLE:
+			/* just the fields we want, unless it's the whole hash */
+			if (festate->filtering)
+				return redisAppendHashFields(context, &festate->filter_fields,
+											 key, keylen);
+			if (festate->fetch_fields.nfields > 0)
+				return redisAppendHashFields(context, &festate->fetch_fields,
+											 key, keylen);
+			return redisAppendCommand(context, "HGETALL %b", key, keylen);
+		case PG_REDIS_LIST_TABLE:
+			return redisAppendCommand(context, "LRANGE %b 0 -1", key, keylen);
+		case PG_REDIS_SET_TABLE:
+			return redisAppendCommand(context, "SMEMBERS %b", key, keylen);
+		case PG_REDIS_ZSET_TABLE:
+		default:
+			return redisAppendCommand(context, "ZRANGE %b 0 -1", key, keylen);
+	}
+}
+
+/*
+ * redisReadMembership
+ *		Read the SISMEMBER replies for the keys of the batch, either from
+ *		context or, if that's NULL, as pending replies of the batch.
+ */
+static void
+redisReadMembership(RedisFdwExecutionState *festate, redisContext *context,
+					long long first, long long last)
+{
+	long long	i;
+
+	if (festate->batch_member == NULL)
+		festate->batch_member = MemoryContextAlloc(festate->scan_cxt,
+												   sizeof(bool) *
+												   festate->fetch_batch_size);
+
+	for (i = first; i < last; i++)
+	{
+		redisReply *sreply = NULL;
+
+		if (context == NULL)
+			sreply = redisGetPendingReply(festate);
+		else if (redisScanBatchReply(festate, context, &sreply) != REDIS_OK ||
+				 sreply == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+					 errmsg("failed to check the keyset: %s",
+							context->errstr)
+					 ));
+
+		festate->batch_member[i - first] =
+			(sreply->type == REDIS_REPLY_INTEGER && sreply->integer == 1);
+	}
+}
+
+/*
+ * redisReadExists
+ *		Read the EXISTS replies for the keys of the batch, and count the ones
+ *		that aren't there as not in the batch.
+ *
+ * In a cluster, a key that has moved gets an error, so we leave it to the
+ * reply for its fields to find out.
+ */
+static void
+redisReadExists(RedisFdwExecutionState *festate, long long first,
+				long long last)
+{
+	long long	i;
+
+	if (festate->batch_member == NULL)
+		festate->batch_member = MemoryContextAlloc(festate->scan_cxt,
+												   sizeof(bool) *
+												   festate->fetch_batch_size);
+
+	for (i = first; i < last; i++)
+	{
+		redisReply *ereply = redisGetPendingReply(festate);
+		bool		exists;
+
+		exists = (ereply->type == REDIS_REPLY_ERROR ||
+				  (ereply->type == REDIS_REPLY_INTEGER &&
+				   ereply->integer > 0));
+
+		if (!festate->batch_checked)
+			festate->batch_member[i - first] = exists;
+		else if (!exists)
+			festate->batch_member[i - first] = false;
+	}
+
+	festate->batch_checked = true;
+}
+
+/*
+ * redisFilterBatch
+ *		Read the fields the filter quals need for each key of the batch,
+ *		check the quals, and queue the HMGET for the rest of the fields of
+ *		the rows that pass.
+ *
+ * The rows that fail are marked as not in the batch, and the fields of the
+ * others are kept in batch_filter until the rows are formed.
+ */
+static void
+redisFilterBatch(RedisFdwExecutionState *festate, long long first,
+				 long long last)
+{
+	long long	i;
+	int			res = REDIS_OK;
+
+	if (festate->batch_member == NULL)
+		festate->batch_member = MemoryContextAlloc(festate->scan_cxt,
+												   sizeof(bool) *
+												   festate->fetch_batch_size);
+
+	festate->filtering = true;
+	festate->text_replies = true;
+	for (i = first; i < last; i++)
+	{
+		redisReply *reply = redisGetKeyReply(festate, i);
+		bool	   *member = &festate->batch_member[i - first];
+
+		if (!festate->batch_checked)
+			*member = true;
+
+		if (*member && reply->type == REDIS_REPLY_ARRAY &&
+			redisCheckFilter(festate, festate->keys[i], reply))
+			festate->batch_filter[i - first] = reply;
+		else
+			*member = false;
+	}
+	festate->filtering = false;
+	festate->batch_checked = true;
+
+	for (i = first; i < last && res == REDIS_OK; i++)
+	{
+		if (!festate->batch_member[i - first])
+			continue;
+		res = redisAppendKeyCommand(festate, festate->batch_context,
+									festate->keys[i], festate->keylens[i]);
+		festate->pending++;
+	}
+
+	if (res != REDIS_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_OUT_OF_MEMORY),
+				 errmsg("failed to queue value commands: %s",
+						festate->batch_context->errstr)
+				 ));
+}
+
+/*
+ * redisCheckFilter
+ *		Check the filter quals against a row made of just the key and the
+ *		fields in the reply.
+ *
+ * The row is formed in the scan slot, which the caller fills in again
+ * afterwards. The quals are checked again on the whole row by the executor.
+ */
+static bool
+redisCheckFilter(RedisFdwExecutionState *festate, char *key,
+				 redisReply *reply)
+{
+	TupleTableSlot *slot = festate->filter_slot;
+	ExprContext *econtext = festate->filter_econtext;
+	int			natts = festate->attinmeta->tupdesc->natts;
+	MemoryContext oldcontext;
+	bool		pass;
+	int			i;
+
+	ExecClearTuple(slot);
+	MemoryContextReset(festate->tuple_cxt);
+	oldcontext = MemoryContextSwitchTo(festate->tuple_cxt);
+
+	for (i = 0; i < natts; i++)
+		slot->tts_isnull[i] = true;
+	slot->tts_values[0] = redisStringDatum(festate, 0, key, strlen(key));
+	slot->tts_isnull[0] = false;
+	redisFormHashFields(festate, &festate->filter_fields, reply,
+						slot->tts_values, slot->tts_isnull);
+
+	MemoryContextSwitchTo(oldcontext);
+	ExecStoreVirtualTuple(slot);
+
+	econtext->ecxt_scantuple = slot;
+	pass = ExecQual(festate->filter_quals, econtext, false);
+
+	ResetExprContext(econtext);
+	ExecClearTuple(slot);
+
+	return pass;
+}
+
+/*
+ * redisFreeBatch
+ *		Free the replies of the last batch, all at once, and forget the
+ *		fields kept for its rows.
+ */
+static void
+redisFreeBatch(RedisFdwExecutionState *festate)
+{
+	if (festate->batch_filter != NULL)
+		memset(festate->batch_filter, 0,
+			   sizeof(redisReply *) * festate->fetch_batch_size);
+
+	/* there's nothing to free if EXPLAIN didn't start the scan */
+	if (festate->reply_cxt != NULL)
+		MemoryContextReset(festate->reply_cxt);
+}
+
+/*
+ * redisGetKeyReply
+ *		Read the reply to the command sent for one key of the batch. In a
+ *		cluster, follow it to another node if it's a redirection.
+ */
+static redisReply *
+redisGetKeyReply(RedisFdwExecutionState *festate, long long row)
+{
+	redisReply *reply = redisGetPendingReply(festate);
+
+	if (festate->cluster && reply->type == REDIS_REPLY_ERROR)
+		reply = redisClusterRedirect(festate, festate->keys[row],
+									 festate->keylens[row], reply);
+
+	return reply;
+}
+
+/*
+ * redisGetPendingReply
+ *		Read the next reply for a command sent by redisSendValueBatch.
+ *
+ * The first call after a batch is sent flushes the commands to the server.
+ */
+static redisReply *
+redisGetPendingReply(RedisFdwExecutionState *festate)
+{
+	redisReply *reply = NULL;
+
+	Assert(festate->pending > 0);
+
+	/* a prefetched SCAN reply may be in the way, so keep it for later */
+	if (festate->prefetch_sent && festate->prefetch_reply == NULL &&
+		festate->prefetch_ahead == 0)
+	{
+		if (redisScanReply(festate, festate->context,
+						   &festate->prefetch_reply) != REDIS_OK ||
+			festate->prefetch_reply == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+					 errmsg("failed to read the next page: %s",
+							festate->context->errstr)
+					 ));
+	}
+
+	if (redisScanBatchReply(festate, festate->batch_context,
+							&reply) != REDIS_OK ||
+		reply == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+				 errmsg("failed to get the values: %s",
+						festate->batch_context->errstr)
+				 ));
+
+	festate->pending--;
+	if (festate->prefetch_ahead > 0)
+		festate->prefetch_ahead--;
+
+	return reply;
+}
+
+/*
+ * redisDrainPending
+ *		Read and throw away any replies we still have coming, e.g. when the
+ *		scan is ended or restarted part way through a batch.
+ */
+static void
+redisDrainPending(RedisFdwExecutionState *festate)
+{
+	while (festate->pending > 0)
+		(void) redisGetPendingReply(festate);
+
+	if (festate->prefetch_sent)
+	{
+		redisReply *reply = redisGetPrefetchedPage(festate);
+
+		if (reply)
+			freeReplyObject(reply);
+	}
+
+	redisFreeBatch(festate);
+
+	festate->batch_reply = NULL;
+	festate->batch_start = 0;
+	festate->batch_end = 0;
+}
+
+/*
+ * redisScanReply
+ *		Read the next reply on one of the scan's connections, like
+ *		redisGetReply, counting it for EXPLAIN ANALYZE.
+ *
+ * If it isn't already in the buffer we have to wait for it, which is what
+ * we count as a round trip.
+ */
+static int
+redisScanReply(RedisFdwExecutionState *festate, redisContext *context,
+			   redisReply **replyp)
+{
+	instr_time	start;
+	instr_time	end;
+
+	*replyp = NULL;
+
+	if (redisGetReplyFromReader(context, (void **) replyp) != REDIS_OK)
+		return REDIS_ERR;
+
+	if (*replyp == NULL)
+	{
+		festate->nround_trips++;
+
+		if (festate->instrument)
+			INSTR_TIME_SET_CURRENT(start);
+
+		if (redisGetReply(context, (void **) replyp) != REDIS_OK)
+			return REDIS_ERR;
+
+		if (festate->instrument)
+		{
+			INSTR_TIME_SET_CURRENT(end);
+			INSTR_TIME_ACCUM_DIFF(festate->wait_time, end, start);
+		}
+	}
+
+	festate->ncommands++;
+	if (festate->instrument)
+		festate->nbytes += redisReplyBytes(*replyp);
+
+	return REDIS_OK;
+}
+
+/*
+ * redisScanCommand
+ *		Send a command and wait for its reply, like redisCommand, counting
+ *		it for EXPLAIN ANALYZE. Returns NULL if it fails.
+ */
+static redisReply *
+redisScanCommand(RedisFdwExecutionState *festate, redisContext *context,
+				 const char *format,...)
+{
+	va_list		args;
+	int			res;
+	redisReply *reply;
+
+	va_start(args, format);
+	res = redisvAppendCommand(context, format, args);
+	va_end(args);
+
+	if (res != REDIS_OK ||
+		redisScanReply(festate, context, &reply) != REDIS_OK)
+		return NULL;
+
+	return reply;
+}
+
+/*
+ * redisScanBatchReply
+ *		Read the next reply for a command of the batch, as redisScanReply
+ *		does, but built in the batch's memory by redis_batch_functions.
+ *
+ * The connection gets hiredis's functions back once we have the reply. If
+ * reading it failed, what the reader was part way through building is
+ * ours, so we leave it ours to free, as the connection is closed anyway.
+ */
+static int
+redisScanBatchReply(RedisFdwExecutionState *festate, redisContext *context,
+					redisReply **replyp)
+{
+	redisReplyObjectFunctions *fn = context->reader->fn;
+	int			res;
+
+	context->reader->fn = &redis_batch_functions;
+	redis_reply_cxt = festate->reply_cxt;
+
+	res = redisScanReply(festate, context, replyp);
+
+	if (res == REDIS_OK)
+		context->reader->fn = fn;
+
+	return res;
+}
+
+/*
+ * redisNewReply
+ *		Make a reply object for the reader's task in redis_reply_cxt, with
+ *		extra bytes after it, and hang it on its parent, if it has one.
+ */
+static redisReply *
+redisNewReply(const redisReadTask *task, size_t extra)
+{
+	redisReply *r;
+
+	r = (redisReply *) MemoryContextAlloc(redis_reply_cxt,
+										  REDIS_REPLY_SIZE + extra);
+	memset(r, 0, sizeof(redisReply));
+	r->type = task->type;
+
+	if (task->parent)
+	{
+		redisReply *parent = (redisReply *) task->parent->obj;
+
+		parent->element[task->idx] = r;
+	}
+
+	return r;
+}
+
+static void *
+redisCreateString(const redisReadTask *task, char *str, size_t len)
+{
+	redisReply *r = redisNewReply(task, VARHDRSZ + len + 1);
+	char	   *text = (char *) r + REDIS_REPLY_SIZE;
+
+	SET_VARSIZE(text, VARHDRSZ + len);
+	r->str = VARDATA(text);
+	r->len = len;
+	memcpy(r->str, str, len);
+	r->str[len] = '\0';
+
+	return r;
+}
+
+static void *
+redisCreateArray(const redisReadTask *task, redisArraySize elements)
+{
+	redisReply *r = redisNewReply(task, sizeof(redisReply *) * elements);
+
+	r->elements = elements;
+	if (elements > 0)
+	{
+		r->element = (redisReply **) ((char *) r + REDIS_REPLY_SIZE);
+		memset(r->element, 0, sizeof(redisReply *) * elements);
+	}
+
+	return r;
+}
+
+static void *
+redisCreateInteger(const redisReadTask *task, long long value)
+{
+	redisReply *r = redisNewReply(task, 0);
+
+	r->integer = value;
+
+	return r;
+}
+
+static void *
+redisCreateNil(const redisReadTask *task)
+{
+	return redisNewReply(task, 0);
+}
+
+static void
+redisFreeObject(void *obj)
+{
+	/* it goes with the rest of the batch */
+}
+
+/*
+ * redisReplyBytes
+ *		Count the bytes of the strings in a reply.
+ */
+static long
+redisReplyBytes(redisReply *reply)
+{
+	long		nbytes = 0;
+	size_t		i;
+
+	if (reply == NULL)
+		return 0;
+
+	switch (reply->type)
+	{
+		case REDIS_REPLY_STRING:
+		case REDIS_REPLY_STATUS:
+		case REDIS_REPLY_ERROR:
+			return reply->len;
+		case REDIS_REPLY_ARRAY:
+			for (i = 0; i < reply->elements; i++)
+				nbytes += redisReplyBytes(reply->element[i]);
+			return nbytes;
+		case REDIS_REPLY_INTEGER:
+			return sizeof(long long);
+	}
+
+	return 0;
+}
+
+/*
+ * redisLoadScanScript
+ *		Load the scan script on the scan's server with SCRIPT LOAD, and
+ *		remember its SHA1 for EVALSHA.
+ */
+static void
+redisLoadScanScript(RedisFdwExecutionState *festate)
+{
+	redisReply *reply;
+
+	reply = redisScanCommand(festate, festate->context, "SCRIPT LOAD %s",
+							 redis_scan_script);
+
+	if (!reply)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+				 errmsg("failed to load the scan script: %s",
+						festate->context->errstr)
+				 ));
+	if (reply->type != REDIS_REPLY_STRING)
+	{
+		char	   *err = pstrdup(reply->type == REDIS_REPLY_ERROR ?
+								  reply->str : "unexpected reply");
+
+		freeReplyObject(reply);
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+				 errmsg("failed to load the scan script: %s", err)
+				 ));
+	}
+
+	if (redis_scan_script_sha == NULL)
+		redis_scan_script_sha = MemoryContextStrdup(TopMemoryContext,
+													reply->str);
+	freeReplyObject(reply);
+}
+
+/*
+ * redisAppendScanScript
+ *		Queue the EVALSHA of the scan script for the next page of the
+ *		cursor, loading the script first if we never have.
+ *
+ * The type is only checked if we read the value, or have to know the key
+ * still exists, and the value is read with the same command as
+ * redisAppendKeyCommand would use.
+ */
+static int
+redisAppendScanScript(RedisFdwExecutionState *festate)
+{
+	const char *argv[10];
+	size_t		argvlen[10];
+	const char **fargv = argv;
+	size_t	   *fargvlen = argvlen;
+	char		count[12];
+	int			argc = 0;
+	int			nextra = 0;
+	const char *command = "";
+	int			res;
+	int			i;
+
+	if (redis_scan_script_sha == NULL)
+		redisLoadScanScript(festate);
+
+	snprintf(count, sizeof(count), "%d", festate->scan_count);
+
+	argv[argc++] = "EVALSHA";
+	argv[argc++] = redis_scan_script_sha;
+	argv[argc++] = festate->keyset ? "1" : "0";
+	if (festate->keyset)
+		argv[argc++] = festate->keyset;
+	argv[argc++] = festate->cursor_id;
+	argv[argc++] = festate->key_pattern ? festate->key_pattern : "";
+	argv[argc++] = count;
+	argv[argc++] = (festate->fetch_values || festate->check_exists) ?
+		redisTableTypeName(festate->table_type) : "";
+
+	if (festate->fetch_values)
+	{
+		switch (festate->table_type)
+		{
+			case PG_REDIS_SCALAR_TABLE:
+				command = "GET";
+				break;
+			case PG_REDIS_HASH_TABLE:
+				command = festate->fetch_fields.nfields > 0 ?
+					"HMGET" : "HGETALL";
+				nextra = festate->fetch_fields.nfields;
+				break;
+			case PG_REDIS_LIST_TABLE:
+				command = "LRANGE";
+				break;
+			case PG_REDIS_SET_TABLE:
+				command = "SMEMBERS";
+				break;
+			case PG_REDIS_ZSET_TABLE:
+			default:
+				command = "ZRANGE";
+				break;
+		}
+	}
+	argv[argc++] = command;
+
+	if (strcmp(command, "LRANGE") == 0 || strcmp(command, "ZRANGE") == 0)
+	{
+		argv[argc++] = "0";
+		argv[argc++] = "-1";
+	}
+
+	/* the fields of an HMGET go after the rest */
+	if (nextra > 0)
+	{
+		fargv = palloc(sizeof(char *) * (argc + nextra));
+		fargvlen = palloc(sizeof(size_t) * (argc + nextra));
+		memcpy(fargv, argv, sizeof(char *) * argc);
+		for (i = 0; i < nextra; i++)
+			fargv[argc + i] = festate->fetch_fields.argv[i + 2];
+		argc += nextra;
+	}
+
+	for (i = 0; i < argc; i++)
+		fargvlen[i] = strlen(fargv[i]);
+
+	res = redisAppendCommandArgv(festate->context, argc, fargv, fargvlen);
+
+	if (fargv != argv)
+	{
+		pfree(fargv);
+		pfree(fargvlen);
+	}
+
+	return res;
+}
+
+/*
+ * redisClusterBeginScan
+ *		Set up a scan of a cluster: take a copy of the slot map, whose
+ *		masters we connect to as we need them.
+ */
+static void
+redisClusterBeginScan(RedisFdwExecutionState *festate,
+					  RedisTableOptions table_options)
+{
+	RedisSlotMapEntry *map = redisGetSlotMap(table_options);
+	int			node;
+
+	festate->cluster = true;
+	festate->options = (redisTableOptions *) palloc(sizeof(redisTableOptions));
+	*festate->options = *table_options;
+	festate->nmasters = map->nnodes;
+	festate->nnodes = map->nnodes;
+	festate->node_addresses = palloc(sizeof(char *) * map->nnodes);
+	festate->node_ports = palloc(sizeof(int) * map->nnodes);
+	festate->node_contexts = palloc0(sizeof(redisContext *) * map->nnodes);
+	festate->node_cursors = palloc0(sizeof(char *) * map->nnodes);
+	festate->node_replies = palloc0(sizeof(redisReply *) * map->nnodes);
+
+	for (node = 0; node < map->nnodes; node++)
+	{
+		festate->node_addresses[node] = pstrdup(map->addresses[node]);
+		festate->node_ports[node] = map->ports[node];
+	}
+
+	festate->slots = palloc(sizeof(int16) * CLUSTER_SLOTS);
+	memcpy(festate->slots, map->slots, sizeof(int16) * CLUSTER_SLOTS);
+	festate->keynodes = NULL;
+}
+
+/*
+ * redisClusterEndScan
+ *		Free the last page and give back the connections to the nodes.
+ */
+static void
+redisClusterEndScan(RedisFdwExecutionState *festate)
+{
+	int			node;
+
+	for (node = 0; node < festate->nnodes; node++)
+	{
+		if (festate->node_replies[node])
+			freeReplyObject(festate->node_replies[node]);
+		festate->node_replies[node] = NULL;
+
+		if (festate->node_contexts[node])
+			redisReleaseConnection(festate->node_contexts[node]);
+		festate->node_contexts[node] = NULL;
+	}
+}
+
+/*
+ * redisClusterNode
+ *		Find a node by address, adding it if it isn't one we know of, as
+ *		when we're redirected to a new master.
+ */
+static int
+redisClusterNode(RedisFdwExecutionState *festate, const char *address,
+				 int port)
+{
+	int			node;
+
+	for (node = 0; node < festate->nnodes; node++)
+	{
+		if (festate->node_ports[node] == port &&
+			strcmp(festate->node_addresses[node], address) == 0)
+			return node;
+	}
+
+	festate->nnodes++;
+	festate->node_addresses = repalloc(festate->node_addresses,
+									   sizeof(char *) * festate->nnodes);
+	festate->node_ports = repalloc(festate->node_ports,
+								   sizeof(int) * festate->nnodes);
+	festate->node_contexts = repalloc(festate->node_contexts,
+									  sizeof(redisContext *) * festate->nnodes);
+	festate->node_cursors = repalloc(festate->node_cursors,
+									 sizeof(char *) * festate->nnodes);
+	festate->node_replies = repalloc(festate->node_replies,
+									 sizeof(redisReply *) * festate->nnodes);
+
+	festate->node_addresses[node] = MemoryContextStrdup(festate->scan_cxt,
+														address);
+	festate->node_ports[node] = port;
+	festate->node_contexts[node] = NULL;
+	festate->node_cursors[node] = NULL;
+	festate->node_replies[node] = NULL;
+
+	return node;
+}
+
+/*
+ * redisClusterConnection
+ *		Get the connection to a node, connecting if we haven't yet.
+ */
+static redisContext *
+redisClusterConnection(RedisFdwExecutionState *festate, int node)
+{
+	if (festate->node_contexts[node] == NULL)
+		festate->node_contexts[node] =
+			redisGetNodeConnection(festate->options,
+								   festate->node_addresses[node],
+								   festate->node_ports[node]);
+
+	return festate->node_contexts[node];
+}
+
+/*
+ * redisClusterFetchNextPage
+ *		Get the next page of keys from the SCAN cursors of all the masters.
+ *
+ * The SCAN for each master that isn't finished is sent before we wait for
+ * any of them, so the masters work on them at the same time, and the page
+ * is all the keys they send back, in order of master.
+ */
+static void
+redisClusterFetchNextPage(RedisFdwExecutionState *festate)
+{
+	long long	nkeys = 0;
+	long long	i;
+	int			node;
+	instr_time	start;
+	redisReply *largest = NULL;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	for (node = 0; node < festate->nmasters; node++)
+	{
+		redisContext *context;
+		int			res;
+		int			done = 0;
+
+		if (festate->node_cursors[node] == NULL)
+			continue;
+
+		context = redisClusterConnection(festate, node);
+
+		if (festate->key_pattern)
+			res = redisAppendCommand(context, "SCAN %s MATCH %s" COUNT,
+									 festate->node_cursors[node],
+									 festate->key_pattern,
+									 festate->scan_count);
+		else
+			res = redisAppendCommand(context, "SCAN %s" COUNT,
+									 festate->node_cursors[node],
+									 festate->scan_count);
+
+		while (res == REDIS_OK && !done)
+			res = redisBufferWrite(context, &done);
+
+		if (res != REDIS_OK)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+					 errmsg("failed to send SCAN to %s:%d: %s",
+							festate->node_addresses[node],
+							festate->node_ports[node], context->errstr)
+					 ));
+	}
+
+	/* the previous page and its last batch are all used up */
+	festate->batch_reply = NULL;
+	festate->batch_start = 0;
+	festate->batch_end = 0;
+
+	for (node = 0; node < festate->nnodes; node++)
+	{
+		if (festate->node_replies[node])
+			freeReplyObject(festate->node_replies[node]);
+		festate->node_replies[node] = NULL;
+	}
+
+	for (node = 0; node < festate->nmasters; node++)
+	{
+		redisContext *context = festate->node_contexts[node];
+		redisReply *reply = NULL;
+		redisReply *cursor;
+
+		if (festate->node_cursors[node] == NULL)
+			continue;
+
+		if (redisScanReply(festate, context, &reply) != REDIS_OK ||
+			reply == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+					 errmsg("failed to list keys on %s:%d: %s",
+							festate->node_addresses[node],
+							festate->node_ports[node], context->errstr)
+					 ));
+
+		/* keep it even if it's bad, so that it gets freed */
+		festate->node_replies[node] = reply;
+
+		if (reply->type == REDIS_REPLY_ERROR)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+					 errmsg("failed somehow: %s", reply->str)
+					 ));
+
+		if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+			reply->element[0]->type != REDIS_REPLY_STRING)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+					 errmsg("wrong reply type %d", reply->type)
+					 ));
+
+		cursor = reply->element[0];
+		if (cursor->len == 1 && cursor->str[0] == '0')
+			festate->node_cursors[node] = NULL;
+		else
+			festate->node_cursors[node] =
+				MemoryContextStrdup(festate->scan_cxt, cursor->str);
+
+		nkeys += reply->element[1]->elements;
+		if (largest == NULL ||
+			reply->element[1]->elements > largest->elements)
+			largest = reply->element[1];
+	}
+
+	/* the scan goes on as long as any master has more */
+	festate->cursor_id = NULL;
+	for (node = 0; node < festate->nmasters; node++)
+	{
+		if (festate->node_cursors[node] != NULL)
+			festate->cursor_id = festate->node_cursors[node];
+	}
+
+	if (largest != NULL)
+		redisAdaptScanCount(festate, &start, largest);
+
+	if (festate->keys)
+	{
+		pfree(festate->keys);
+		pfree(festate->keylens);
+	}
+	if (festate->keynodes)
+		pfree(festate->keynodes);
+	festate->keys = MemoryContextAlloc(festate->scan_cxt,
+									   sizeof(char *) * (nkeys + 1));
+	festate->keylens = MemoryContextAlloc(festate->scan_cxt,
+										  sizeof(size_t) * (nkeys + 1));
+	festate->keynodes = MemoryContextAlloc(festate->scan_cxt,
+										   sizeof(int) * (nkeys + 1));
+
+	nkeys = 0;
+	for (node = 0; node < festate->nmasters; node++)
+	{
+		redisReply *elements;
+
+		if (festate->node_replies[node] == NULL)
+			continue;
+
+		elements = festate->node_replies[node]->element[1];
+		for (i = 0; i < elements->elements; i++)
+		{
+			festate->keys[nkeys] = elements->element[i]->str;
+			festate->keylens[nkeys] = elements->element[i]->len;
+			festate->keynodes[nkeys++] = node;
+		}
+	}
+	festate->nkeys = nkeys;
+	festate->row = 0;
+
+	if (festate->seen_keys)
+		redisDedupePage(festate, true);
+
+	/* the cursor only gives us keys that were there when it reached them */
+	festate->check_exists = festate->strict_existence;
+}
+
+/*
+ * redisClusterRoutePage
+ *		Put the keys of the current page in order of the master that holds
+ *		them, according to our slot map, so each batch goes to one node.
+ *
+ * The new key arrays are made in the current memory context, which must
+ * be the one the page's keys are kept in.
+ */
+static void
+redisClusterRoutePage(RedisFdwExecutionState *festate)
+{
+	long long	nkeys = festate->nkeys;
+	char	  **keys = palloc(sizeof(char *) * (nkeys + 1));
+	size_t	   *keylens = palloc(sizeof(size_t) * (nkeys + 1));
+	int		   *keynodes = palloc(sizeof(int) * (nkeys + 1));
+	int		   *next = palloc0(sizeof(int) * (festate->nnodes + 1));
+	long long	i;
+	int			node;
+
+	/* count the keys on each node, then find where each node's keys start */
+	for (i = 0; i < nkeys; i++)
+	{
+		node = festate->slots[redisKeySlot(festate->keys[i],
+										   festate->keylens[i])];
+
+		/* an unassigned slot gets an error from whichever node we ask */
+		keynodes[i] = Max(node, 0);
+		next[keynodes[i] + 1]++;
+	}
+	for (node = 0; node < festate->nnodes; node++)
+		next[node + 1] += next[node];
+
+	for (i = 0; i < nkeys; i++)
+	{
+		long long	pos = next[keynodes[i]]++;
+
+		keys[pos] = festate->keys[i];
+		keylens[pos] = festate->keylens[i];
+	}
+	for (node = 0, i = 0; i < nkeys; i++)
+	{
+		while (i >= next[node])
+			node++;
+		keynodes[i] = node;
+	}
+
+	pfree(next);
+	pfree(festate->keys);
+	pfree(festate->keylens);
+	if (festate->keynodes)
+		pfree(festate->keynodes);
+
+	festate->keys = keys;
+	festate->keylens = keylens;
+	festate->keynodes = keynodes;
+}
+
+/*
+ * redisClusterRedirect
+ *		If the reply for a key is a MOVED or ASK error, send the command
+ *		for the key to the node it names, and return that node's reply
+ *		instead. A MOVED also means our slot maps are out of date.
+ */
+static redisReply *
+redisClusterRedirect(RedisFdwExecutionState *festate, const char *key,
+					 size_t keylen, redisReply *reply)
+{
+	int			redirects;
+
+	for (redirects = 0; redirects < CLUSTER_MAX_REDIRECTS; redirects++)
+	{
+		bool		ask;
+		char	   *target;
+		char	   *colon;
+		char	   *address;
+		int			node;
+		redisContext *context;
+		int			res;
+
+		if (reply->type != REDIS_REPLY_ERROR)
+			break;
+
+		if (strncmp(reply->str, "MOVED ", 6) == 0)
+			ask = false;
+		else if (strncmp(reply->str, "ASK ", 4) == 0)
+			ask = true;
+		else
+			break;
+
+		/* the error is MOVED or ASK, the slot, then host:port */
+		target = strchr(reply->str + (ask ? 4 : 6), ' ');
+		colon = target ? strrchr(target, ':') : NULL;
+		if (colon == NULL)
+			break;
+
+		/* no host means the node doesn't know its address; try the server's */
+		address = colon > target + 1 ?
+			pnstrdup(target + 1, colon - target - 1) :
+			pstrdup(festate->options->address);
+		node = redisClusterNode(festate, address, atoi(colon + 1));
+		pfree(address);
+
+		if (!ask)
+		{
+			RedisSlotMapEntry *map;
+
+			festate->slots[redisKeySlot(key, keylen)] = node;
+
+			map = hash_search(SlotMapHash, &festate->options->serverid,
+							  HASH_FIND, NULL);
+			if (map)
+				map->valid = false;
+		}
+
+		/* the error was read into the batch's memory, as one chunk */
+		pfree(reply);
+		reply = NULL;
+
+		context = redisClusterConnection(festate, node);
+
+		/* an ASK is only good for the one command after ASKING */
+		res = REDIS_OK;
+		if (ask)
+			res = redisAppendCommand(context, "ASKING");
+		if (res == REDIS_OK)
+			res = redisAppendKeyCommand(festate, context, key, keylen);
+
+		if (res == REDIS_OK && ask)
+		{
+			res = redisScanBatchReply(festate, context, &reply);
+			if (res == REDIS_OK && reply != NULL)
+				pfree(reply);
+			reply = NULL;
+		}
+
+		if (res == REDIS_OK)
+			res = redisScanBatchReply(festate, context, &reply);
+
+		if (res != REDIS_OK || reply == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+					 errmsg("failed to get the value from %s:%d: %s",
+							festate->node_addresses[node],
+							festate->node_ports[node], context->errstr)
+					 ));
+	}
+
+	return reply;
+}
+
+static inline TupleTableSlot *
+redisIterateForeignScanSingleton(ForeignScanState *node)
+{
+	bool		found;
+	int			natts;
+	int			i;
+	Datum	   *values;
+	bool	   *nulls;
+	MemoryContext oldcontext;
+
+	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisIterateForeignScanSingleton");
+#endif
+
+	/* Cleanup */
+	ExecClearTuple(slot);
+
+	if (festate->row < 0)
+		return slot;
+
+	/* We fill in the slot directly; the first two columns are all we set */
+	natts = festate->attinmeta->tupdesc->natts;
+	values = slot->tts_values;
+	nulls = slot->tts_isnull;
+	for (i = 0; i < natts; i++)
+		nulls[i] = true;
+
+	MemoryContextReset(festate->tuple_cxt);
+	oldcontext = MemoryContextSwitchTo(festate->tuple_cxt);
+
+	/* Get the next record, and set found */
+	found = false;
+
+	if (festate->table_type == PG_REDIS_SCALAR_TABLE)
+	{
+		festate->row = -1; /* just one row for a scalar */
+		switch (festate->reply->type)
+		{
+			case REDIS_REPLY_INTEGER:
+			case REDIS_REPLY_STRING:
+				if (natts > 0)
+					values[0] = redisReplyDatum(festate, 0, festate->reply,
+												&nulls[0]);
+				found = true;
+				break;
+				
+			case REDIS_REPLY_ARRAY:
+				ereport(ERROR, (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+								errmsg("not expecting an array for a singleton scalar table")
+							));
+				break;
+		}
+	}
+	else if (festate->table_type == PG_REDIS_HASH_TABLE && festate->qual_value)
+	{
+		festate->row = -1; /* just one row for qual'd search in a hash */
+		switch (festate->reply->type)
+		{
+			case REDIS_REPLY_INTEGER:
+			case REDIS_REPLY_STRING:
+				if (natts > 0)
+				{
+					values[0] = redisStringDatum(festate, 0, festate->qual_value,
+												 strlen(festate->qual_value));
+					nulls[0] = false;
+				}
+				if (natts > 1)
+					values[1] = redisReplyDatum(festate, 1, festate->reply,
+												&nulls[1]);
+				found = true;
+				break;
+				
+			case REDIS_REPLY_ARRAY:
+				ereport(ERROR, (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+								errmsg("not expecting an array for a single hash property: %s", festate->qual_value)
+							));
+				break;
+		}
+	}
+	else if ((festate->reply != NULL &&
+			  festate->row < festate->reply->elements) ||
+			 (festate->singleton_stream && redisFetchSingletonPage(festate)))
+	{
+		/* everything else comes in as an array reply type */
+		found = true;
+		if (natts > 0)
+			values[0] = redisReplyDatum(festate, 0,
+										festate->reply->element[festate->row],
+										&nulls[0]);
+		festate->row++;
+		if (festate->table_type == PG_REDIS_HASH_TABLE || 
+			(festate->table_type == PG_REDIS_ZSET_TABLE &&
+			 festate->zset_range != PG_REDIS_ZSET_LEX))
+		{
+			redisReply *dreply = festate->reply->element[festate->row];
+			
+			if (dreply->type == REDIS_REPLY_ARRAY)
+				ereport(ERROR, (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+								errmsg("not expecting array for a hash value or zset score")
+							));
+			if (natts > 1)
+				values[1] = redisReplyDatum(festate, 1, dreply, &nulls[1]);
+			festate->row++;
+		}
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (found)
+		ExecStoreVirtualTuple(slot);
+
+	return slot;
+}
+
+/*
+ * redisEndForeignScan
+ *		Finish scanning foreign table and dispose objects used for this scan
+ */
+static void
+redisEndForeignScan(ForeignScanState *node)
+{
+	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisEndForeignScan");
+#endif
+
+	/* if festate is NULL, we are in EXPLAIN; nothing to do */
+	if (festate)
+	{
+		/*
+		 * The connection goes back to the cache, so read any replies still
+		 * coming for a batch we didn't finish.
+		 */
+		redisDrainPending(festate);
+
+		if (festate->scan_reply)
+			freeReplyObject(festate->scan_reply);
+		else if (festate->page_reply)
+			freeReplyObject(festate->page_reply);
+		else if (festate->reply && !festate->singleton_stream)
+			freeReplyObject(festate->reply);
+
+		if (festate->cluster)
+			redisClusterEndScan(festate);
+
+		/* there's no connection for EXPLAIN */
+		if (festate->context)
+			redisReleaseConnection(festate->context);
+	}
+}
+
+/*
+ * redisReScanForeignScan
+ *		Rescan table, possibly with new parameters
+ */
+static void
+redisReScanForeignScan(ForeignScanState *node)
+{
+	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisReScanForeignScan");
+#endif
+
+	if (festate->pending > 0 || festate->batch_reply ||
+		festate->prefetch_sent)
+		redisDrainPending(festate);
+
+	if (festate->param_exprs != NIL)
+	{
+		/* if the parameters have changed, so has the key we look up */
+		if (node->ss.ps.chgParam != NULL)
+			festate->param_pending = true;
+	}
+	else if (festate->cursor_search_string)
+	{
+		/* start the cursor over; the first page is fetched on demand */
+		redisStartCursor(festate);
+		festate->nkeys = 0;
+	}
+	else if (festate->singleton_stream)
+	{
+		/* likewise for the pages of a singleton */
+		if (festate->page_reply)
+			freeReplyObject(festate->page_reply);
+		festate->page_reply = NULL;
+		festate->reply = NULL;
+		festate->cursor_id = ZERO;
+		festate->window_start = festate->offset;
+	}
+
+	if (festate->row > -1)
+		festate->row = 0;
+	festate->nreturned = 0;
+}
+
+/*
+ * redisAnalyzeForeignTable
+ *		Test whether analyzing this foreign table is supported
+ *
+ * A singleton table is a single key, so there's nothing worth sampling.
+ */
+static bool
+redisAnalyzeForeignTable(Relation relation,
+						 AcquireSampleRowsFunc *func,
+						 BlockNumber *totalpages)
+{
+	redisTableOptions table_options;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisAnalyzeForeignTable");
+#endif
+
+	redisGetOptions(RelationGetRelid(relation), &table_options);
+
+	if (table_options.singleton_key)
+		return false;
+
+	*func = redisAcquireSampleRowsFunc;
+
+	/*
+	 * Redis has no pages, but relpages > 0 is how the planner can tell the
+	 * table has been analyzed.
+	 */
+	*totalpages = 1;
+
+	return true;
+}
+
+/*
+ * redisAcquireSampleRowsFunc
+ *		Acquire a random sample of rows from the foreign table
+ *
+ * We run the cursor over the whole table, keeping a reservoir sample of the
+ * keys as we go, and only then fetch the values of the sampled keys, in the
+ * same pipelined batches as a scan does. Keys that have gone by the time we
+ * fetch them are treated as dead rows.
+ */
+static int
+redisAcquireSampleRowsFunc(Relation relation, int elevel,
+						   HeapTuple *rows, int targrows,
+						   double *totalrows,
+						   double *totaldeadrows)
+{
+	redisTableOptions table_options;
+	RedisFdwExecutionState *festate;
+	char	  **sample;
+	int			nsample = 0;
+	int			numrows = 0;
+	double		rstate;
+	double		rowstoskip = -1;
+	List	   *keys = NIL;
+	redisReply *reply;
+	char	   *key;
+	long long	i;
+	TupleDesc	tupdesc = RelationGetDescr(relation);
+	Datum	   *values;
+	bool	   *nulls;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisAcquireSampleRowsFunc");
+#endif
+
+	redisGetOptions(RelationGetRelid(relation), &table_options);
+
+	festate = (RedisFdwExecutionState *) palloc0(sizeof(RedisFdwExecutionState));
+	festate->context = redisGetTableConnection(&table_options);
+	festate->keyprefix = table_options.keyprefix;
+	festate->keyset = table_options.keyset;
+	festate->table_type = table_options.table_type;
+	festate->fetch_batch_size = table_options.fetch_batch_size;
+	festate->scan_count = table_options.scan_count;
+	festate->reply_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											   "redis_fdw batch replies",
+											   ALLOCSET_DEFAULT_MINSIZE,
+											   ALLOCSET_DEFAULT_INITSIZE,
+											   ALLOCSET_DEFAULT_MAXSIZE);
+	festate->scan_cxt = CurrentMemoryContext;
+	festate->adaptive_scan_count = table_options.adaptive_scan_count;
+	festate->fetch_values = true;
+	if (table_options.table_type == PG_REDIS_HASH_TABLE)
+		festate->field_names = redisGetHashFields(relation);
+	festate->key_pattern = table_options.keyprefix ?
+		psprintf("%s*", table_options.keyprefix) : NULL;
+	festate->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+	festate->attkinds = redisGetAttKinds(tupdesc);
+	if (table_options.cluster)
+		redisClusterBeginScan(festate, &table_options);
+	redisStartCursor(festate);
+
+	sample = (char **) palloc(sizeof(char *) * targrows);
+	rstate = anl_init_selection_state(targrows);
+	*totalrows = 0;
+	*totaldeadrows = 0;
+
+	while (festate->cursor_id != NULL)
+	{
+		vacuum_delay_point();
+
+		redisFetchNextPage(festate);
+
+		for (i = 0; i < festate->nkeys; i++)
+		{
+			/*
+			 * The first targrows keys go straight into the sample; after that
+			 * we replace them at random, as in acquire_sample_rows.
+			 */
+			if (nsample < targrows)
+				sample[nsample++] = pstrdup(festate->keys[i]);
+			else
+			{
+				if (rowstoskip < 0)
+					rowstoskip = anl_get_next_S(*totalrows, targrows, &rstate);
+
+				if (rowstoskip <= 0)
+				{
+					int			k = (int) (targrows * anl_random_fract());
+
+					Assert(k >= 0 && k < targrows);
+					pfree(sample[k]);
+					sample[k] = pstrdup(festate->keys[i]);
+				}
+
+				rowstoskip -= 1;
+			}
+
+			*totalrows += 1;
+		}
+	}
+
+	/* now get the rows for the sampled keys */
+	for (i = 0; i < nsample; i++)
+		keys = lappend(keys, sample[i]);
+
+	redisSetKeyList(festate, keys);
+
+	/* they all came from the keyset, so there's no need to check */
+	festate->check_keyset = false;
+
+	values = (Datum *) palloc(sizeof(Datum) * tupdesc->natts);
+	nulls = (bool *) palloc(sizeof(bool) * tupdesc->natts);
+
+	while (redisFetchNextValue(festate, &key, &reply))
+	{
+		redisFormMultiRow(festate, key, reply, values, nulls);
+		rows[numrows++] = heap_form_tuple(tupdesc, values, nulls);
+	}
+
+	if (nsample > numrows)
+	{
+		*totaldeadrows = *totalrows * (nsample - numrows) / nsample;
+		*totalrows -= *totaldeadrows;
+	}
+
+	if (festate->scan_reply)
+		freeReplyObject(festate->scan_reply);
+	if (festate->cluster)
+		redisClusterEndScan(festate);
+	redisReleaseConnection(festate->context);
+
+	ereport(elevel,
+			(errmsg("\"%s\": table contains %.0f keys; %d rows in sample",
+					RelationGetRelationName(relation),
+					*totalrows, numrows)));
+
+	return numrows;
+}
+
+/*
+ * redisAddForeignUpdateTargets
+ *		Add the key as a junk column, so we know which key to update or
+ *		delete.
+ */
+static void
+redisAddForeignUpdateTargets(Query *parsetree,
+							 RangeTblEntry *target_rte,
+							 Relation target_relation)
+{
+	AttrNumber	key_attnum;
+	Form_pg_attribute attr;
+	Var		   *var;
+	TargetEntry *tle;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisAddForeignUpdateTargets");
+#endif
+
+	key_attnum = redisGetAttnum(RelationGetDescr(target_relation), "key");
+	if (key_attnum == InvalidAttrNumber)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_COLUMN_NAME_NOT_FOUND),
+				 errmsg("foreign table \"%s\" has no key column",
+						RelationGetRelationName(target_relation))
+				 ));
+
+	attr = RelationGetDescr(target_relation)->attrs[key_attnum - 1];
+
+	var = makeVar(parsetree->resultRelation,
+				  key_attnum,
+				  attr->atttypid,
+				  attr->atttypmod,
+				  attr->attcollation,
+				  0);
+
+	tle = makeTargetEntry((Expr *) var,
+						  list_length(parsetree->targetList) + 1,
+						  pstrdup(REDIS_KEY_JUNK),
+						  true);
+
+	parsetree->targetList = lappend(parsetree->targetList, tle);
+}
+
+/*
+ * redisBeginForeignModify
+ *		Get a connection and set up the write batch
+ */
+static void
+redisBeginForeignModify(ModifyTableState *mtstate,
+						ResultRelInfo *rinfo,
+						List *fdw_private,
+						int subplan_index,
+						int eflags)
+{
+	redisTableOptions table_options;
+	RedisFdwModifyState *fmstate;
+	Relation	rel = rinfo->ri_RelationDesc;
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Oid			typoutput;
+	bool		typisvarlena;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisBeginForeignModify");
+#endif
+
+	/*
+	 * We don't read a row before we update or delete it, so there's
+	 * nothing to return. An insert returns the row it was given.
+	 */
+	if (mtstate->operation != CMD_INSERT &&
+		((ModifyTable *) mtstate->ps.plan)->returningLists != NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("RETURNING is not supported for UPDATE or DELETE on a Redis table")
+				 ));
+
+	/* nothing to do for EXPLAIN */
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	redisGetOptions(RelationGetRelid(rel), &table_options);
+
+	fmstate = (RedisFdwModifyState *) palloc0(sizeof(RedisFdwModifyState));
+	fmstate->operation = mtstate->operation;
+	fmstate->table_type = table_options.table_type;
+	fmstate->keyprefix = table_options.keyprefix;
+	fmstate->keyset = table_options.keyset;
+	fmstate->write_batch_size = table_options.write_batch_size;
+
+	fmstate->key_attnum = redisGetAttnum(tupdesc, "key");
+	fmstate->value_attnum = redisGetAttnum(tupdesc, "value");
+
+	/* a hash's fields can be written from their own columns instead */
+	if (fmstate->table_type == PG_REDIS_HASH_TABLE)
+		fmstate->field_names = redisGetHashFields(rel);
+	if (fmstate->field_names != NULL)
+	{
+		int			i;
+
+		if (fmstate->value_attnum != InvalidAttrNumber &&
+			fmstate->field_names[fmstate->value_attnum - 1] != NULL)
+			fmstate->value_attnum = InvalidAttrNumber;
+
+		fmstate->field_out = (FmgrInfo *) palloc0(sizeof(FmgrInfo) *
+												  tupdesc->natts);
+		for (i = 0; i < tupdesc->natts; i++)
+		{
+			if (fmstate->field_names[i] == NULL)
+				continue;
+			getTypeOutputInfo(tupdesc->attrs[i]->atttypid,
+							  &typoutput, &typisvarlena);
+			fmgr_info(typoutput, &fmstate->field_out[i]);
+		}
+	}
+
+	if (fmstate->key_attnum == InvalidAttrNumber ||
+		(fmstate->operation != CMD_DELETE &&
+		 fmstate->value_attnum == InvalidAttrNumber &&
+		 fmstate->field_names == NULL))
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_COLUMN_NAME_NOT_FOUND),
+				 errmsg("foreign table \"%s\" must have key and value "
+						"columns to be modified",
+						RelationGetRelationName(rel))
+				 ));
+
+	getTypeOutputInfo(tupdesc->attrs[fmstate->key_attnum - 1]->atttypid,
+					  &typoutput, &typisvarlena);
+	fmgr_info(typoutput, &fmstate->key_out);
+	if (fmstate->value_attnum != InvalidAttrNumber)
+	{
+		fmstate->value_type =
+			tupdesc->attrs[fmstate->value_attnum - 1]->atttypid;
+		getTypeOutputInfo(fmstate->value_type, &typoutput, &typisvarlena);
+		fmgr_info(typoutput, &fmstate->value_out);
+	}
+
+	/* UPDATE and DELETE get the old key from the junk column */
+	if (fmstate->operation != CMD_INSERT)
+	{
+		Plan	   *subplan = mtstate->mt_plans[subplan_index]->plan;
+
+		fmstate->junk_attnum =
+			ExecFindJunkAttributeInTlist(subplan->targetlist, REDIS_KEY_JUNK);
+		if (!AttributeNumberIsValid(fmstate->junk_attnum))
+			elog(ERROR, "could not find junk key column");
+	}
+
+	/*
+	 * Scalar rows, deletions and keyset changes are collected into single
+	 * variadic commands, which need room for the whole batch.
+	 */
+	fmstate->argv = palloc(sizeof(char *) *
+						   (fmstate->write_batch_size * 2 + 1));
+	fmstate->argvlen = palloc(sizeof(size_t) *
+							  (fmstate->write_batch_size * 2 + 1));
+	fmstate->setargv = palloc(sizeof(char *) *
+							  (fmstate->write_batch_size + 2));
+	fmstate->setargvlen = palloc(sizeof(size_t) *
+								 (fmstate->write_batch_size + 2));
+	fmstate->batch_cxt = AllocSetContextCreate(mtstate->ps.state->es_query_cxt,
+											   "redis_fdw write batch",
+											   ALLOCSET_DEFAULT_MINSIZE,
+											   ALLOCSET_DEFAULT_INITSIZE,
+											   ALLOCSET_DEFAULT_MAXSIZE);
+	redisResetWriteBatch(fmstate);
+
+	fmstate->context = redisGetConnection(&table_options);
+
+	rinfo->ri_FdwState = fmstate;
+}
+
+/*
+ * redisExecForeignInsert
+ *		Queue a row to be written to Redis
+ */
+static TupleTableSlot *
+redisExecForeignInsert(EState *estate,
+					   ResultRelInfo *rinfo,
+					   TupleTableSlot *slot,
+					   TupleTableSlot *planSlot)
+{
+	RedisFdwModifyState *fmstate = (RedisFdwModifyState *) rinfo->ri_FdwState;
+	MemoryContext oldcontext;
+	char	   *key;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisExecForeignInsert");
+#endif
+
+	oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+
+	key = redisGetWriteKey(fmstate, slot, fmstate->key_attnum, false);
+	redisQueueValue(fmstate, key, slot);
+
+	if (fmstate->keyset)
+	{
+		fmstate->setargv[fmstate->setargc] = key;
+		fmstate->setargvlen[fmstate->setargc] = strlen(key);
+		fmstate->setargc++;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (++fmstate->nrows >= fmstate->write_batch_size)
+		redisFlushWriteBatch(fmstate);
+
+	return slot;
+}
+
+/*
+ * redisExecForeignUpdate
+ *		Queue a new value for a key to be written to Redis
+ */
+static TupleTableSlot *
+redisExecForeignUpdate(EState *estate,
+					   ResultRelInfo *rinfo,
+					   TupleTableSlot *slot,
+					   TupleTableSlot *planSlot)
+{
+	RedisFdwModifyState *fmstate = (RedisFdwModifyState *) rinfo->ri_FdwState;
+	MemoryContext oldcontext;
+	char	   *oldkey;
+	char	   *key;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisExecForeignUpdate");
+#endif
+
+	oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+
+	oldkey = redisGetWriteKey(fmstate, planSlot, fmstate->junk_attnum, true);
+	key = redisGetWriteKey(fmstate, slot, fmstate->key_attnum, false);
+
+	/*
+	 * A renamed key could be found again by the cursor we're updating from,
+	 * so we don't allow it.
+	 */
+	if (strcmp(oldkey, key) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot change the key of a Redis row"),
+				 errhint("Use DELETE and INSERT instead.")
+				 ));
+
+	redisQueueValue(fmstate, key, slot);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (++fmstate->nrows >= fmstate->write_batch_size)
+		redisFlushWriteBatch(fmstate);
+
+	return slot;
+}
+
+/*
+ * redisExecForeignDelete
+ *		Queue a key to be deleted from Redis
+ */
+static TupleTableSlot *
+redisExecForeignDelete(EState *estate,
+					   ResultRelInfo *rinfo,
+					   TupleTableSlot *slot,
+					   TupleTableSlot *planSlot)
+{
+	RedisFdwModifyState *fmstate = (RedisFdwModifyState *) rinfo->ri_FdwState;
+	MemoryContext oldcontext;
+	char	   *key;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisExecForeignDelete");
+#endif
+
+	oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+
+	key = redisGetWriteKey(fmstate, planSlot, fmstate->junk_attnum, true);
+
+	fmstate->argv[fmstate->argc] = key;
+	fmstate->argvlen[fmstate->argc] = strlen(key);
+	fmstate->argc++;
+
+	if (fmstate->keyset)
+	{
+		fmstate->setargv[fmstate->setargc] = key;
+		fmstate->setargvlen[fmstate->setargc] = strlen(key);
+		fmstate->setargc++;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (++fmstate->nrows >= fmstate->write_batch_size)
+		redisFlushWriteBatch(fmstate);
+
+	return slot;
+}
+
+/*
+ * redisEndForeignModify
+ *		Write out the last batch and give the connection back
+ */
+static void
+redisEndForeignModify(EState *estate, ResultRelInfo *rinfo)
+{
+	RedisFdwModifyState *fmstate = (RedisFdwModifyState *) rinfo->ri_FdwState;
+
+#ifdef DEBUG
+	elog(NOTICE, "redisEndForeignModify");
+#endif
+
+	/* if fmstate is NULL, we are in EXPLAIN; nothing to do */
+	if (fmstate)
+	{
+		redisFlushWriteBatch(fmstate);
+		redisReleaseConnection(fmstate->context);
+	}
+}
+
+/*
+ * redisIsForeignRelUpdatable
+ *		Only tables of scalars or hashes stored under their own keys can be
+ *		modified.
+ */
+static int
+redisIsForeignRelUpdatable(Relation rel)
+{
+	redisTableOptions table_options;
+
+	redisGetOptions(RelationGetRelid(rel), &table_options);
+
+	/* writes aren't routed to cluster nodes */
+	if (table_options.singleton_key != NULL || table_options.cluster ||
+		(table_options.table_type != PG_REDIS_SCALAR_TABLE &&
+		 table_options.table_type != PG_REDIS_HASH_TABLE))
+		return 0;
+
+	return (1 << CMD_INSERT) | (1 << CMD_UPDATE) | (1 << CMD_DELETE);
+}
+
+/*
+ * redisGetAttnum
+ *		Find a column by name, returning InvalidAttrNumber if there's none.
+ */
+static AttrNumber
+redisGetAttnum(TupleDesc tupdesc, const char *attname)
+{
+	int			i;
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		if (!tupdesc->attrs[i]->attisdropped &&
+			strcmp(NameStr(tupdesc->attrs[i]->attname), attname) == 0)
+			return i + 1;
+	}
+
+	return InvalidAttrNumber;
 }
 
-static inline TupleTableSlot *
-redisIterateForeignScanMulti(ForeignScanState *node)
+/*
+ * redisGetWriteKey
+ *		Get the key from a row to be written, and check it belongs in the
+ *		table.
+ */
+static char *
+redisGetWriteKey(RedisFdwModifyState *fmstate, TupleTableSlot *slot,
+				 AttrNumber attnum, bool junk)
 {
-	bool		found;
-	redisReply *reply = 0;
+	Datum		datum;
+	bool		isnull;
 	char	   *key;
-	char	   *data = 0;
-	char	  **values;
-	HeapTuple	tuple;
 
-	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
-	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	if (junk)
+		datum = ExecGetJunkAttribute(slot, attnum, &isnull);
+	else
+		datum = slot_getattr(slot, attnum, &isnull);
 
-#ifdef DEBUG
-	elog(NOTICE, "redisIterateForeignScanMulti");
-#endif
+	if (isnull)
+		ereport(ERROR,
+				(errcode(ERRCODE_NOT_NULL_VIOLATION),
+				 errmsg("Redis keys cannot be null")
+				 ));
 
-	/* Cleanup */
-	ExecClearTuple(slot);
+	key = OutputFunctionCall(&fmstate->key_out, datum);
 
-	/* Get the next record, and set found */
-	found = false;
+	if (fmstate->keyprefix &&
+		strncmp(key, fmstate->keyprefix, strlen(fmstate->keyprefix)) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				 errmsg("key \"%s\" does not start with the table's key "
+						"prefix \"%s\"", key, fmstate->keyprefix)
+				 ));
 
-	/*
-	 * If we're out of rows on the cursor, fetch the next set.
-	 * Keep going until we get a result back that actually has some rows.
-	 */
-	while (festate->cursor_id != NULL &&
-		   festate->row >= festate->reply->elements)
+	return key;
+}
+
+/*
+ * redisQueueValue
+ *		Queue the value of a row to be written under the key.
+ *
+ * Scalars go into the batch's MSET. A hash replaces whatever was there, so
+ * it's written as a DEL and an HMSET, which go straight into the pipeline;
+ * we use HMSET rather than a variadic HSET so older servers work too.
+ *
+ * The columns of single fields are written along with the value, and a
+ * null one is left out. Without a value column, an UPDATE only changes the
+ * fields that have columns, deleting the ones that are set to null.
+ */
+static void
+redisQueueValue(RedisFdwModifyState *fmstate, char *key,
+				TupleTableSlot *slot)
+{
+	Datum		datum;
+	bool		isnull;
+	char	   *value;
+
+	if (fmstate->table_type == PG_REDIS_SCALAR_TABLE)
 	{
-		redisReply *creply;
-		redisReply *cursor;
+		datum = slot_getattr(slot, fmstate->value_attnum, &isnull);
 
-		Assert(festate->qual_value == NULL);
+		if (isnull)
+			ereport(ERROR,
+					(errcode(ERRCODE_NOT_NULL_VIOLATION),
+					 errmsg("Redis values cannot be null")
+					 ));
 
-		if (festate->keyset)
-		{
-			creply = redisCommand(festate->context,
-								  festate->cursor_search_string,
-								  festate->keyset, festate->cursor_id);
-		}
-		else if (festate->keyprefix)
-		{
-			creply = redisCommand(festate->context,
-								  festate->cursor_search_string,
-								  festate->cursor_id, festate->keyprefix);
-		}
+		value = OutputFunctionCall(&fmstate->value_out, datum);
+
+		fmstate->argv[fmstate->argc] = key;
+		fmstate->argvlen[fmstate->argc] = strlen(key);
+		fmstate->argc++;
+		fmstate->argv[fmstate->argc] = value;
+		fmstate->argvlen[fmstate->argc] = strlen(value);
+		fmstate->argc++;
+	}
+	else
+	{
+		ArrayType  *array;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		const char **argv;
+		size_t	   *argvlen;
+		int			argc;
+		const char **delargv = NULL;
+		size_t	   *delargvlen = NULL;
+		int			delargc = 2;
+		int			natts = slot->tts_tupleDescriptor->natts;
+		bool		replace;
+		int			i;
+
+		/* the value is the field names and values, in turn */
+		if (fmstate->value_attnum == InvalidAttrNumber)
+			isnull = true;
 		else
-		{
-			creply = redisCommand(festate->context,
-								  festate->cursor_search_string,
-								  festate->cursor_id);
-		}
+			datum = slot_getattr(slot, fmstate->value_attnum, &isnull);
 
-		if (!creply)
+		if (isnull)
+			nelems = 0;
+		else
 		{
-			redisFree(festate->context);
-			ereport(ERROR,
-					(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
-					 errmsg("failed to list keys: %s",
-							festate->context->errstr)
-						));
+			if (fmstate->value_type == TEXTARRAYOID)
+				array = DatumGetArrayTypeP(datum);
+			else
+				array = DatumGetArrayTypeP(DirectFunctionCall3(array_in,
+						 CStringGetDatum(OutputFunctionCall(&fmstate->value_out,
+															datum)),
+												ObjectIdGetDatum(TEXTOID),
+														 Int32GetDatum(-1)));
+
+			deconstruct_array(array, TEXTOID, -1, false, 'i',
+							  &elems, &nulls, &nelems);
 		}
-		else if (creply->type == REDIS_REPLY_ERROR)
-		{
-			char	   *err = pstrdup(creply->str);
 
-			freeReplyObject(creply);
+		if (nelems % 2 != 0)
 			ereport(ERROR,
-					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-					 errmsg("failed somehow: %s", err)
-						));
-		}
+					(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+					 errmsg("hash value for key \"%s\" must have an even "
+							"number of elements", key)
+					 ));
 
-		cursor  = creply->element[0];
+		replace = (fmstate->value_attnum != InvalidAttrNumber ||
+				   fmstate->operation == CMD_INSERT);
 
-		if (cursor->type == REDIS_REPLY_STRING)
+		if (replace)
 		{
-			if (cursor->len == 1 && cursor->str[0] == '0')
-				festate->cursor_id = NULL;
-			else
-				festate->cursor_id = pstrdup(cursor->str);
+			if (redisAppendCommand(fmstate->context, "DEL %s",
+								   key) != REDIS_OK)
+				redisWriteError(fmstate);
+			fmstate->pending++;
 		}
-		else
+
+		argv = palloc(sizeof(char *) * (nelems + natts * 2 + 2));
+		argvlen = palloc(sizeof(size_t) * (nelems + natts * 2 + 2));
+		argv[0] = "HMSET";
+		argvlen[0] = 5;
+		argv[1] = key;
+		argvlen[1] = strlen(key);
+		for (i = 0; i < nelems; i++)
 		{
-			ereport(ERROR,
-					(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
-					 errmsg("wrong reply type %d", cursor->type)
-						));
+			if (nulls[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_NOT_NULL_VIOLATION),
+						 errmsg("hash fields and values cannot be null")
+						 ));
+			argv[i + 2] = TextDatumGetCString(elems[i]);
+			argvlen[i + 2] = strlen(argv[i + 2]);
 		}
+		argc = nelems + 2;
 
-		festate->reply = creply->element[1];
-		festate->row = 0;
-	}
-
-	/*
-	 * -1 means we failed the qual test, so there are no rows
-	 * or we've already processed the qual
-	 */
-
-	if (festate->row >  -1 &&
-		(festate->qual_value != NULL ||
-		 (festate->row < festate->reply->elements)))
-	{
-		/*
-		 * Get the row, check the result type, and handle accordingly. If it's
-		 * nil, we go ahead and get the next row.
-		 */
-		do
+		if (fmstate->field_names != NULL)
 		{
-
-			key = festate->qual_value != NULL ?
-				festate->qual_value :
-				festate->reply->element[festate->row]->str;
-			switch(festate->table_type)
-			{
-				case PG_REDIS_HASH_TABLE:
-					reply = redisCommand(festate->context, 
-										  "HGETALL %s", key);
-					break;
-				case PG_REDIS_LIST_TABLE:
-					reply = redisCommand(festate->context, 
-										  "LRANGE %s 0 -1", key);
-					break;
-				case PG_REDIS_SET_TABLE:
-					reply = redisCommand(festate->context, 
-										  "SMEMBERS %s", key);
-					break;
-				case PG_REDIS_ZSET_TABLE:
-					reply = redisCommand(festate->context, 
-										  "ZRANGE %s 0 -1", key);
-					break;
-				case PG_REDIS_SCALAR_TABLE:
-				default:
-					reply = redisCommand(festate->context, 
-										 "GET %s", key);
-			}
-
-			if (!reply)
+			delargv = palloc(sizeof(char *) * (natts + 2));
+			delargvlen = palloc(sizeof(size_t) * (natts + 2));
+			delargv[0] = "HDEL";
+			delargvlen[0] = 4;
+			delargv[1] = key;
+			delargvlen[1] = strlen(key);
+
+			for (i = 0; i < natts; i++)
 			{
-				freeReplyObject(festate->reply);
-				redisFree(festate->context);
-				ereport(ERROR, (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
-								errmsg("failed to get the value for key \"%s\": %s",
-									   key, festate->context->errstr)
-								));
-			}
-
-			festate->row++;
+				const char *field = fmstate->field_names[i];
 
-		} while ((reply->type == REDIS_REPLY_NIL ||
-				  reply->type == REDIS_REPLY_STATUS ||
-				  reply->type == REDIS_REPLY_ERROR) &&
-				 festate->qual_value == NULL &&
-				 festate->row < festate->reply->elements);
+				if (field == NULL)
+					continue;
 
-		if (festate->qual_value != NULL || festate->row <= festate->reply->elements)
-		{
-			/*
-			 * Now, deal with the different data types we might have got from
-			 * Redis.
-			 */
+				datum = slot_getattr(slot, i + 1, &isnull);
+				if (isnull)
+				{
+					delargv[delargc] = field;
+					delargvlen[delargc] = strlen(field);
+					delargc++;
+					continue;
+				}
 
-			switch (reply->type)
-			{
-				case REDIS_REPLY_INTEGER:
-					data = (char *) palloc(sizeof(char) * 64);
-					snprintf(data, 64, "%lld", reply->integer);
-					found = true;
-					break;
-
-				case REDIS_REPLY_STRING:
-					data = reply->str;
-					found = true;
-					break;
-
-				case REDIS_REPLY_ARRAY:
-					data = process_redis_array(reply, festate->table_type);
-					found = true;
-					break;
+				argv[argc] = field;
+				argvlen[argc] = strlen(field);
+				argc++;
+				argv[argc] = OutputFunctionCall(&fmstate->field_out[i],
+												datum);
+				argvlen[argc] = strlen(argv[argc]);
+				argc++;
 			}
 		}
 
-		/* make sure we don't try to process the qual row twice */
-		if (festate->qual_value != NULL)
-			festate->row = -1;
-	}
+		/* Redis has no empty hashes, so that's the same as deleting it */
+		if (argc > 2)
+		{
+			if (redisAppendCommandArgv(fmstate->context, argc,
+									   argv, argvlen) != REDIS_OK)
+				redisWriteError(fmstate);
+			fmstate->pending++;
+		}
 
-	/* Build the tuple */
-	if (found)
-	{
-		values = (char **) palloc(sizeof(char *) * 2);
-		values[0] = key;
-		values[1] = data;
-		tuple = BuildTupleFromCStrings(festate->attinmeta, values);
-		ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+		/* a field we didn't just replace may need deleting */
+		if (!replace && delargc > 2)
+		{
+			if (redisAppendCommandArgv(fmstate->context, delargc,
+									   delargv, delargvlen) != REDIS_OK)
+				redisWriteError(fmstate);
+			fmstate->pending++;
+		}
 	}
-
-	/* Cleanup */
-	if (reply)
-		freeReplyObject(reply);
-
-	return slot;
 }
 
-static inline TupleTableSlot *
-redisIterateForeignScanSingleton(ForeignScanState *node)
+/*
+ * redisFlushWriteBatch
+ *		Send everything queued for the batch, and check all the replies.
+ */
+static void
+redisFlushWriteBatch(RedisFdwModifyState *fmstate)
 {
-	bool		found;
-	char	   *key = NULL;
-	char	   *data = NULL;
-	char	  **values;
-	HeapTuple	tuple;
-
-	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
-	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
-
-#ifdef DEBUG
-	elog(NOTICE, "redisIterateForeignScanSingleton");
-#endif
-
-	/* Cleanup */
-	ExecClearTuple(slot);
-
-	if (festate->row < 0)
-		return slot;
-
-	/* Get the next record, and set found */
-	found = false;
+	redisReply *reply;
+	char	   *err = NULL;
 
-	if (festate->table_type == PG_REDIS_SCALAR_TABLE)
-	{
-		festate->row = -1; /* just one row for a scalar */
-		switch (festate->reply->type)
-		{
-			case REDIS_REPLY_INTEGER:
-				key = (char *) palloc(sizeof(char) * 64);
-				snprintf(key, 64, "%lld", festate->reply->integer);
-				found = true;
-				break;
-				
-			case REDIS_REPLY_STRING:
-				key = festate->reply->str;
-				found = true;
-				break;
-				
-			case REDIS_REPLY_ARRAY:
-				freeReplyObject(festate->reply);
-				redisFree(festate->context);
-				ereport(ERROR, (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
-								errmsg("not expecting an array for a singleton scalar table")
-							));
-				break;
-		}
-	}
-	else if (festate->table_type == PG_REDIS_HASH_TABLE && festate->qual_value)
+	if (fmstate->argc > 1)
 	{
-		festate->row = -1; /* just one row for qual'd search in a hash */
-		key = festate->qual_value;
-		switch (festate->reply->type)
-		{
-			case REDIS_REPLY_INTEGER:
-			    data = (char *) palloc(sizeof(char) * 64);
-				snprintf(data, 64, "%lld", festate->reply->integer);
-				found = true;
-				break;
-				
-			case REDIS_REPLY_STRING:
-				data = festate->reply->str;
-				found = true;
-				break;
-				
-			case REDIS_REPLY_ARRAY:
-				freeReplyObject(festate->reply);
-				redisFree(festate->context);
-				ereport(ERROR, (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
-								errmsg("not expecting an array for a single hash property: %s", festate->qual_value)
-							));
-				break;
-		}
+		if (redisAppendCommandArgv(fmstate->context, fmstate->argc,
+								   fmstate->argv, fmstate->argvlen) != REDIS_OK)
+			redisWriteError(fmstate);
+		fmstate->pending++;
 	}
-	else if (festate->row < festate->reply->elements)
+
+	if (fmstate->setargc > 2)
 	{
-		/* everything else comes in as an array reply type */
-		found = true;
-		key = festate->reply->element[festate->row]->str;
-		festate->row++;
-		if (festate->table_type == PG_REDIS_HASH_TABLE || 
-			festate->table_type == PG_REDIS_ZSET_TABLE)
-		{
-			redisReply *dreply = festate->reply->element[festate->row];
-			
-			switch (dreply->type)
-			{
-				case REDIS_REPLY_INTEGER:
-					data = (char *) palloc(sizeof(char) * 64);
-					snprintf(key, 64, "%lld", dreply->integer);
-					break;
-
-				case REDIS_REPLY_STRING:
-					data = dreply->str;
-					break;
-
-				case REDIS_REPLY_ARRAY:
-					freeReplyObject(festate->reply);
-					redisFree(festate->context);
-					ereport(ERROR, (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
-									errmsg("not expecting array for a hash value or zset score")
-								));
-					break;
-			}
-			festate->row++;
-		}
+		if (redisAppendCommandArgv(fmstate->context, fmstate->setargc,
+								   fmstate->setargv,
+								   fmstate->setargvlen) != REDIS_OK)
+			redisWriteError(fmstate);
+		fmstate->pending++;
 	}
 
-	/* Build the tuple */
-	values = (char **) palloc(sizeof(char *) * 2);
-
-	if (found)
+	/*
+	 * Read every reply even if one of them is an error, so the connection
+	 * is in a fit state to be used again.
+	 */
+	while (fmstate->pending > 0)
 	{
-		values[0] = key;
-		values[1] = data;
-		tuple = BuildTupleFromCStrings(festate->attinmeta, values);
-		ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+		if (redisGetReply(fmstate->context, (void **) &reply) != REDIS_OK)
+			redisWriteError(fmstate);
+		fmstate->pending--;
+
+		if (reply->type == REDIS_REPLY_ERROR && err == NULL)
+			err = pstrdup(reply->str);
+		freeReplyObject(reply);
 	}
 
-	return slot;
+	redisResetWriteBatch(fmstate);
+
+	if (err)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_ERROR),
+				 errmsg("failed to write to Redis: %s", err)
+				 ));
 }
 
 /*
- * redisEndForeignScan
- *		Finish scanning foreign table and dispose objects used for this scan
+ * redisResetWriteBatch
+ *		Start a new, empty batch.
  */
 static void
-redisEndForeignScan(ForeignScanState *node)
+redisResetWriteBatch(RedisFdwModifyState *fmstate)
 {
-	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
+	MemoryContextReset(fmstate->batch_cxt);
 
-#ifdef DEBUG
-	elog(NOTICE, "redisEndForeignScan");
-#endif
+	fmstate->nrows = 0;
 
-	/* if festate is NULL, we are in EXPLAIN; nothing to do */
-	if (festate)
-	{
-		if (festate->reply)
-			freeReplyObject(festate->reply);
+	fmstate->argv[0] = (fmstate->operation == CMD_DELETE) ? "DEL" : "MSET";
+	fmstate->argvlen[0] = strlen(fmstate->argv[0]);
+	fmstate->argc = 1;
 
-		if (festate->context)
-			redisFree(festate->context);
-	}
+	fmstate->setargv[0] = (fmstate->operation == CMD_DELETE) ? "SREM" : "SADD";
+	fmstate->setargvlen[0] = 4;
+	fmstate->setargv[1] = fmstate->keyset;
+	fmstate->setargvlen[1] = fmstate->keyset ? strlen(fmstate->keyset) : 0;
+	fmstate->setargc = 2;
 }
 
 /*
- * redisReScanForeignScan
- *		Rescan table, possibly with new parameters
+ * redisWriteError
+ *		Report a failure to send a write or get its reply.
  */
 static void
-redisReScanForeignScan(ForeignScanState *node)
+redisWriteError(RedisFdwModifyState *fmstate)
 {
-	RedisFdwExecutionState *festate = (RedisFdwExecutionState *) node->fdw_state;
-
-#ifdef DEBUG
-	elog(NOTICE, "redisReScanForeignScan");
-#endif
-
-	if (festate->row > -1)
-		festate->row = 0;
+	ereport(ERROR,
+			(errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+			 errmsg("failed to write to Redis: %s",
+					fmstate->context->errstr)
+			 ));
 }
 
 static void
-redisGetQual(Node *node, TupleDesc tupdesc, char **key, char **value, bool *pushdown)
+redisGetQual(Node *node, TupleDesc tupdesc, char **key, char **value, List **values, bool *pushdown)
 {
 	*key = NULL;
 	*value = NULL;
+	*values = NIL;
 	*pushdown = false;
 
 	if (!node)
@@ -1508,7 +7776,7 @@ redisGetQual(Node *node, TupleDesc tupdesc, char **key, char **value, bool *push
 		OpExpr	   *op = (OpExpr *) node;
 		Node	   *left,
 				   *right;
-		Index		varattno;
+		AttrNumber	varattno;
 
 		if (list_length(op->args) != 2)
 			return;
@@ -1518,7 +7786,10 @@ redisGetQual(Node *node, TupleDesc tupdesc, char **key, char **value, bool *push
 		if (!IsA(left, Var))
 			return;
 
+		/* system columns and whole-row references can't be the key */
 		varattno = ((Var *) left)->varattno;
+		if (varattno <= 0)
+			return;
 
 		right = list_nth(op->args, 1);
 
@@ -1530,17 +7801,94 @@ redisGetQual(Node *node, TupleDesc tupdesc, char **key, char **value, bool *push
 
 			/* And get the column and value... */
 			*key = NameStr(tupdesc->attrs[varattno - 1]->attname);
-			*value = TextDatumGetCString(((Const *) right)->constvalue);
 
 			/*
 			 * We can push down this qual if: - The operatory is TEXTEQ - The
-			 * qual is on the key column
+			 * qual is on the key column, which has to be the first, as that's
+			 * where the key goes. Other columns may not be text.
 			 */
-			if (op->opfuncid == PROCID_TEXTEQ && strcmp(*key, "key") == 0)
+			if (op->opfuncid == PROCID_TEXTEQ && varattno == 1 &&
+				strcmp(*key, "key") == 0)
+			{
+				*value = TextDatumGetCString(((Const *) right)->constvalue);
+				*values = list_make1(*value);
 				*pushdown = true;
+			}
+
+			return;
+		}
+	}
+	else if (IsA(node, ScalarArrayOpExpr))
+	{
+		/* key IN (...) and key = ANY(...) both come to us like this */
+		ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) node;
+		Node	   *left,
+				   *right;
+		AttrNumber	varattno;
+
+		if (list_length(op->args) != 2 || !op->useOr)
+			return;
+
+		left = list_nth(op->args, 0);
+
+		if (!IsA(left, Var))
+			return;
 
+		varattno = ((Var *) left)->varattno;
+		if (varattno <= 0)
+			return;
+		*key = NameStr(tupdesc->attrs[varattno - 1]->attname);
+
+		if (op->opfuncid != PROCID_TEXTEQ || varattno != 1 ||
+			strcmp(*key, "key") != 0)
 			return;
+
+		right = list_nth(op->args, 1);
+
+		if (IsA(right, Const))
+		{
+			Const	   *array = (Const *) right;
+			Datum	   *elems;
+			bool	   *nulls;
+			int			nelems;
+			int			i;
+
+			if (array->constisnull)
+				return;
+
+			deconstruct_array(DatumGetArrayTypeP(array->constvalue),
+							  TEXTOID, -1, false, 'i',
+							  &elems, &nulls, &nelems);
+
+			/* a NULL can't match anything, so just leave it out */
+			for (i = 0; i < nelems; i++)
+			{
+				if (!nulls[i])
+					*values = lappend(*values, TextDatumGetCString(elems[i]));
+			}
+			*pushdown = true;
+		}
+		else if (IsA(right, ArrayExpr))
+		{
+			ListCell   *lc;
+
+			foreach(lc, ((ArrayExpr *) right)->elements)
+			{
+				Node	   *elem = (Node *) lfirst(lc);
+
+				if (!IsA(elem, Const))
+				{
+					*values = NIL;
+					return;
+				}
+				if (!((Const *) elem)->constisnull)
+					*values = lappend(*values,
+									  TextDatumGetCString(((Const *) elem)->constvalue));
+			}
+			*pushdown = true;
 		}
+
+		return;
 	}
 
 	return;
@@ -1570,23 +7918,19 @@ process_redis_array(redisReply *reply,	redis_table_type type)
             case REDIS_REPLY_STATUS:
             case REDIS_REPLY_STRING:
 			{
-				char *buff;
-				char *crs;
-				int i;
+				int j;
                 pg_verifymbstr(ir->str, ir->len, false);
-				buff = palloc(ir->len * 2 + 3);
-				crs = buff;
-				*crs++ = '"';
-				for (i = 0; i < ir->len; i++)
+				/* quote and escape it straight into the result */
+				enlargeStringInfo(res, ir->len * 2 + 2);
+				res->data[res->len++] = '"';
+				for (j = 0; j < ir->len && ir->str[j] != '\0'; j++)
 				{
-					if (ir->str[i] == '"' || ir->str[i] == '\\')
-						*crs++ = '\\';
-					*crs++ = ir->str[i];
+					if (ir->str[j] == '"' || ir->str[j] == '\\')
+						res->data[res->len++] = '\\';
+					res->data[res->len++] = ir->str[j];
 				}
-				*crs++ = '"';
-				*crs = '\0';
-                appendStringInfoString(res,buff);
-				pfree(buff);
+				res->data[res->len++] = '"';
+				res->data[res->len] = '\0';
 			}
                 break;
             case REDIS_REPLY_INTEGER:
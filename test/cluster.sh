@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Run the Redis Cluster regression tests against a throwaway single-node
+# cluster. The node is started on port 6391, which the tests use, with
+# persistence off, is given all the slots, and is shut down again at the
+# end. The arguments are the pg_regress command to run once it's ready.
+#
+
+set -e
+
+: ${REDIS_SERVER:=redis-server}
+: ${REDIS_CLI:=redis-cli}
+REDIS_PORT=6391
+
+WORK=$(mktemp -d)
+
+redis()
+{
+	"$REDIS_CLI" -p "$REDIS_PORT" "$@"
+}
+
+cleanup()
+{
+	redis shutdown nosave >/dev/null 2>&1 || true
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if redis ping >/dev/null 2>&1
+then
+	echo "something is already listening on port $REDIS_PORT" >&2
+	trap - EXIT
+	rm -rf "$WORK"
+	exit 1
+fi
+
+echo "starting a single-node redis cluster on port $REDIS_PORT" >&2
+"$REDIS_SERVER" --port "$REDIS_PORT" --save "" --appendonly no \
+	--cluster-enabled yes --cluster-config-file "$WORK/nodes.conf" \
+	--dir "$WORK" --daemonize yes --pidfile "$WORK/redis.pid" >/dev/null
+until redis ping >/dev/null 2>&1
+do
+	sleep 0.1
+done
+
+redis cluster addslots $(seq 0 16383) >/dev/null
+until redis cluster info | grep -q '^cluster_state:ok'
+do
+	sleep 0.1
+done
+
+"$@"
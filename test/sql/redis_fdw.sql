@@ -67,6 +67,42 @@ select * from db15 order by key;
 
 select * from db15 where key = 'foo';
 
+select * from db15 where key in ('foo', 'baz', 'nosuch') order by key;
+select key from db15 where tableoid = any('{1,2}');
+
+-- key lookups from the inner side of a nested loop
+create temp table lookups(k text);
+insert into lookups values ('foo'), ('nosuch'), (null);
+set enable_hashjoin = off;
+set enable_mergejoin = off;
+select l.k, d.value from lookups l join db15 d on d.key = l.k order by 1;
+reset enable_hashjoin;
+reset enable_mergejoin;
+
+-- key-only scans
+select key from db15 order by key;
+select count(*) from db15_hash;
+
+-- small, adaptive and prefetched scan pages
+alter foreign table db15 options (add scan_count '1');
+select key from db15 order by key;
+alter foreign table db15 options (set scan_count '10', add adaptive_scan_count 'true');
+select key from db15 order by key;
+alter foreign table db15 options (set scan_count '1', drop adaptive_scan_count, add prefetch 'true');
+select * from db15 order by key;
+alter foreign table db15 options (drop scan_count, drop prefetch);
+
+-- values read on the server by the scan script
+alter foreign table db15 options (add scan_mode 'script', add scan_count '1', add prefetch 'true');
+select * from db15 order by key;
+select key from db15 order by key;
+alter foreign table db15 options (drop scan_mode, drop scan_count, drop prefetch);
+
+-- keys seen before are dropped
+alter foreign table db15 options (add scan_dedupe 'true', add scan_count '1');
+select * from db15 order by key;
+alter foreign table db15 options (drop scan_dedupe, drop scan_count);
+
 -- hash
 
 create foreign table db15_hash_prefix(key text, value text)
@@ -84,12 +120,34 @@ create foreign table db15_hash_keyset_array(key text, value text[])
 select * from db15_hash_prefix order by key;
 select * from db15_hash_prefix where key = 'hash1';
 
+select * from db15_hash_prefix where key like 'hash2%';
+
+analyze db15_hash_prefix;
+select reltuples from pg_class where relname = 'db15_hash_prefix';
+
+select key from db15 where key ~ '^fo';
+
+-- an alternation can match keys outside the prefix
+select key from db15 where key ~ '^fo|z$' order by key;
+
+-- the key is always the first column, even if another is called key
+create foreign table db15_key_second(value text, key text)
+       server localredis
+       options (database '15');
+select * from db15_key_second where key like 'ba%';
+
 select * from db15_hash_prefix_array order by key;
 select * from db15_hash_prefix_array where key = 'hash1';
 
 select * from db15_hash_keyset_array order by key;
 select * from db15_hash_keyset_array where key = 'hash1';
 
+alter foreign table db15_hash_keyset_array options (add scan_mode 'script');
+select * from db15_hash_keyset_array order by key;
+alter foreign table db15_hash_keyset_array options (drop scan_mode);
+
+select * from db15_hash_keyset_array where key = any(array['hash2', 'hash3']);
+
 -- a couple of nifty things we an do with hash tables
 
 select key, hstore(value) from db15_hash_prefix_array order by key;
@@ -100,6 +158,23 @@ select key, (populate_record(null::atab, hstore(value))).*
 from db15_hash_prefix_array
 order by key;
 
+-- hash fields
+
+create foreign table db15_hash_fields(key text, k1 text, k2 text, k5 int)
+       server localredis
+       options (tabletype 'hash', tablekeyprefix 'hash', database '15');
+
+create foreign table db15_hash_field_opts(key text, first text options (field 'k1'), value text[])
+       server localredis
+       options (tabletype 'hash', tablekeyset 'hkeys', database '15');
+
+select * from db15_hash_fields order by key;
+select key, k2 from db15_hash_fields where k1 = 'v5';
+select key, k2 from db15_hash_fields where key = 'hash1' and k1 <> 'v1';
+select key from db15_hash_fields where k5 is null order by key;
+select * from db15_hash_field_opts order by key;
+select key, first from db15_hash_field_opts where key = 'hash2';
+
 -- set
 
 create foreign table db15_set_prefix(key text, value text)
@@ -190,6 +265,10 @@ create foreign table db15_1key_hash(key text, value text)
 
 select * from db15_1key_hash order by key;
 
+alter foreign table db15_1key_hash options (add singleton_stream 'false');
+
+select * from db15_1key_hash order by key;
+
 
 -- singleton set
 
@@ -226,10 +305,70 @@ create foreign table db15_1key_zset_scores(value text, score numeric)
 
 select * from db15_1key_zset_scores order by score desc;
 
+-- singleton zset ranges
+
+select * from db15_1key_zset_scores where score > 2 and score <= 5 order by score desc;
+alter foreign table db15_1key_zset_scores options (add scan_count '2');
+select * from db15_1key_zset_scores where 4 <= score order by score;
+select * from db15_1key_zset_scores where score = 3;
+
+create foreign table db15_1key_zset_lex(value text collate "C")
+       server localredis
+       options (tabletype 'zset', singleton_key 'lexzset', lex_range 'true', database '15');
+
+select * from db15_1key_zset_lex where value > 'b' and value <= 'd' order by value;
+
+-- limits
+
+select * from db15_1key_list limit 2 offset 1;
+alter foreign table db15_1key_list options (add singleton_stream 'false');
+select * from db15_1key_list limit 2 offset 1;
+select * from db15_1key_zset_scores order by score desc limit 2 offset 1;
+select value from db15_1key_zset_lex where value >= 'b' limit 2;
+select count(*) from (select key from db15 limit 1) s;
+
+-- counts
+
+select count(*) from db15_1key_list;
+select count(*) from db15_1key_zset_lex where value > 'a';
+alter foreign table db15_hash_keyset_array options (add strict_existence 'false');
+select count(*) from db15_hash_keyset_array;
+-- the key is never NULL, so count(key) is counted the same way
+select count(key) from db15_hash_keyset_array;
+select count(key) from db15_1key_hash;
 
 
 
 
+
+-- writes
+create foreign table db15_w_scalar(key text, value text)
+       server localredis
+       options (database '15', tablekeyprefix 'w_');
+insert into db15_w_scalar values ('w_a', 'one'), ('w_b', 'two');
+insert into db15_w_scalar values ('x', 'bad');
+update db15_w_scalar set value = 'uno' where key = 'w_a';
+update db15_w_scalar set key = 'w_c' where key = 'w_a';
+delete from db15_w_scalar where key = 'w_b';
+delete from db15_w_scalar where key = 'w_a' returning *;
+select * from db15_w_scalar order by key;
+create foreign table db15_w_hash(key text, value text[])
+       server localredis
+       options (database '15', tabletype 'hash', tablekeyset 'w_hkeys');
+insert into db15_w_hash values ('w_h1', '{f1,v1,f2,v2}');
+select * from db15_w_hash;
+delete from db15_w_hash;
+select count(*) from db15_w_hash;
+create foreign table db15_w_hash_fields(key text, f1 text, f2 int)
+       server localredis
+       options (database '15', tabletype 'hash', tablekeyset 'w_hkeys');
+insert into db15_w_hash_fields values ('w_h2', 'a', 1), ('w_h3', 'b', null);
+update db15_w_hash_fields set f1 = null, f2 = 2 where key = 'w_h2';
+select * from db15_w_hash_fields order by key;
+select * from db15_w_hash order by key;
+delete from db15_w_hash_fields;
+select count(*) from db15_w_hash_fields;
+
 -- all done,so now blow everything in the db away agan
 
 \! redis-cli < test/sql/redis_clean
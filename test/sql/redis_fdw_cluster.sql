@@ -0,0 +1,50 @@
+--
+-- Redis Cluster tests, run by "make installcheck-cluster" against the
+-- single-node cluster that test/cluster.sh starts on port 6391
+--
+
+create server localcluster foreign data wrapper redis_fdw
+       options (port '6391', cluster 'true');
+
+create user mapping for public server localcluster;
+
+create foreign table cl_scalar(key text, value text)
+       server localcluster
+       options (tablekeyprefix 's_');
+
+create foreign table cl_hash(key text, value text[])
+       server localcluster
+       options (tabletype 'hash', tablekeyset 'hkeys');
+
+create foreign table cl_hash_fields(key text, f1 text, f2 text)
+       server localcluster
+       options (tabletype 'hash', tablekeyset 'hkeys');
+
+create foreign table cl_list(value text)
+       server localcluster
+       options (tabletype 'list', singleton_key 'list1');
+
+\! redis-cli -p 6391 < test/sql/redis_cluster_setup
+
+-- a full scan asks every master
+select * from cl_scalar order by key;
+
+-- and again a key or so at a time, in batches of two
+alter foreign table cl_scalar options (add scan_count '1', fetch_batch_size '2');
+select * from cl_scalar order by key;
+select count(*) from cl_scalar;
+
+-- keys from a qual go to the master that holds each of them
+select * from cl_scalar where key = 's_b';
+select * from cl_scalar where key in ('s_a', 's_e', 's_nosuch') order by key;
+
+-- the keyset is read from its own master
+select * from cl_hash order by key;
+select * from cl_hash_fields where f1 = 'v1';
+
+select * from cl_list;
+
+-- writes aren't routed to cluster nodes
+insert into cl_scalar values ('s_z', 'no');
+
+\! redis-cli -p 6391 flushall